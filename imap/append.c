@@ -313,6 +313,7 @@ EXPORTED FILE *append_newstage(const char *mailboxname, time_t internaldate,
 
     stage = xmalloc(sizeof(struct stagemsg));
     strarray_init(&stage->parts);
+    message_guid_set_null(&stage->guid);
 
     snprintf(stage->fname, sizeof(stage->fname), "%d-%d-%d",
              (int) getpid(), (int) internaldate, msgnum);
@@ -818,6 +819,72 @@ out:
     return r;
 }
 
+/*
+ * Make sure 'stage' has a copy on the partition of 'mboxname', creating
+ * it from the first stage part if needed, and return its name in
+ * 'stagefile'.
+ */
+static int append_stageonpart(struct stagemsg *stage, const char *mboxname,
+                              char *stagefile, size_t len)
+{
+    int i, r;
+
+    /* xxx check errors */
+    mboxlist_findstage(mboxname, stagefile, len);
+    strlcat(stagefile, stage->fname, len);
+
+    for (i = 0 ; i < stage->parts.count ; i++) {
+        /* ok, we've successfully created the file */
+        if (!strcmp(stagefile, stage->parts.data[i])) {
+            /* aha, this is us */
+            return 0;
+        }
+    }
+
+    /* ok, create this file, and copy the name of it into stage->parts. */
+
+    /* create the new staging file from the first stage part */
+    r = mailbox_copyfile(stage->parts.data[0], stagefile, 0);
+    if (r) {
+        /* maybe the directory doesn't exist? */
+        char stagedir[MAX_MAILBOX_PATH+1];
+
+        /* xxx check errors */
+        mboxlist_findstage(mboxname, stagedir, sizeof(stagedir));
+        if (mkdir(stagedir, 0755) != 0) {
+            syslog(LOG_ERR, "couldn't create stage directory: %s: %m",
+                   stagedir);
+        } else {
+            syslog(LOG_NOTICE, "created stage directory %s",
+                   stagedir);
+            r = mailbox_copyfile(stage->parts.data[0], stagefile, 0);
+        }
+    }
+    if (r) {
+        /* oh well, we tried */
+
+        syslog(LOG_ERR, "IOERROR: creating message file %s: %m",
+               stagefile);
+        unlink(stagefile);
+        return r;
+    }
+
+    strarray_append(&stage->parts, stagefile);
+
+    return 0;
+}
+
+/*
+ * Create the copy of 'stage' for the partition of 'mboxname' up front,
+ * e.g. before handing the stage to several delivery processes.
+ */
+EXPORTED int append_preparestage(struct stagemsg *stage, const char *mboxname)
+{
+    char stagefile[MAX_MAILBOX_PATH+1];
+
+    return append_stageonpart(stage, mboxname, stagefile, sizeof(stagefile));
+}
+
 /*
  * staging, to allow for single-instance store.  the complication here
  * is multiple partitions.
@@ -833,7 +900,7 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
     struct mailbox *mailbox = as->mailbox;
     struct index_record record;
     const char *fname;
-    int i, r;
+    int r;
     strarray_t *newflags = NULL;
     struct entryattlist *system_annots = NULL;
     struct mboxevent *mboxevent = NULL;
@@ -848,7 +915,7 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
     if (!*body) {
         FILE *file = fopen(stage->parts.data[0], "r");
         if (file) {
-            r = message_parse_file(file, NULL, NULL, body);
+            r = message_parse_file_guid(file, NULL, NULL, body, &stage->guid);
             fclose(file);
         }
         else
@@ -858,49 +925,8 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
 
     zero_index(record);
 
-    /* xxx check errors */
-    mboxlist_findstage(mailbox->name, stagefile, sizeof(stagefile));
-    strlcat(stagefile, stage->fname, sizeof(stagefile));
-
-    for (i = 0 ; i < stage->parts.count ; i++) {
-        /* ok, we've successfully created the file */
-        if (!strcmp(stagefile, stage->parts.data[i])) {
-            /* aha, this is us */
-            break;
-        }
-    }
-
-    if (i == stage->parts.count) {
-        /* ok, create this file, and copy the name of it into stage->parts. */
-
-        /* create the new staging file from the first stage part */
-        r = mailbox_copyfile(stage->parts.data[0], stagefile, 0);
-        if (r) {
-            /* maybe the directory doesn't exist? */
-            char stagedir[MAX_MAILBOX_PATH+1];
-
-            /* xxx check errors */
-            mboxlist_findstage(mailbox->name, stagedir, sizeof(stagedir));
-            if (mkdir(stagedir, 0755) != 0) {
-                syslog(LOG_ERR, "couldn't create stage directory: %s: %m",
-                       stagedir);
-            } else {
-                syslog(LOG_NOTICE, "created stage directory %s",
-                       stagedir);
-                r = mailbox_copyfile(stage->parts.data[0], stagefile, 0);
-            }
-        }
-        if (r) {
-            /* oh well, we tried */
-
-            syslog(LOG_ERR, "IOERROR: creating message file %s: %m",
-                   stagefile);
-            unlink(stagefile);
-            goto out;
-        }
-
-        strarray_append(&stage->parts, stagefile);
-    }
+    r = append_stageonpart(stage, mailbox->name, stagefile, sizeof(stagefile));
+    if (r) goto out;
 
     /* 'stagefile' contains the message and is on the same partition
        as the mailbox we're looking at */
@@ -942,6 +968,8 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
         goto out;
     }
 
+    if (!nolink) mailbox_guidstore_link(mailbox, &record);
+
     if (config_getstring(IMAPOPT_ANNOTATION_CALLOUT)) {
         if (flags)
             newflags = strarray_dup(flags);
@@ -1077,6 +1105,7 @@ EXPORTED int append_fromstream(struct appendstate *as, struct body **body,
 {
     struct mailbox *mailbox = as->mailbox;
     struct index_record record;
+    struct message_guid guid;
     const char *fname;
     FILE *destfile;
     int r;
@@ -1110,10 +1139,10 @@ EXPORTED int append_fromstream(struct appendstate *as, struct body **body,
     /* XXX - also stream to stage directory and check out archive options */
 
     /* Copy and parse message */
-    r = message_copy_strict(messagefile, destfile, size, 0);
+    r = message_copy_strict(messagefile, destfile, size, 0, &guid);
     if (!r) {
         if (!*body || (as->nummsg - 1))
-            r = message_parse_file(destfile, NULL, NULL, body);
+            r = message_parse_file_guid(destfile, NULL, NULL, body, &guid);
         if (!r) r = message_create_record(&record, *body);
 
         /* messageContent may be included with MessageAppend and MessageNew */
@@ -1123,6 +1152,8 @@ EXPORTED int append_fromstream(struct appendstate *as, struct body **body,
     fclose(destfile);
     if (r) goto out;
 
+    mailbox_guidstore_link(mailbox, &record);
+
     /* Handle flags the user wants to set in the message */
     if (flags) {
         r = append_apply_flags(as, mboxevent, &record, flags);
@@ -1330,6 +1361,8 @@ EXPORTED int append_copy(struct mailbox *mailbox, struct appendstate *as,
         r = mailbox_copyfile(srcfname, destfname, nolink);
         if (r) goto out;
 
+        if (!nolink) mailbox_guidstore_link(as->mailbox, &record);
+
         int in_object_storage = 0;
         if (object_storage_enabled && record.system_flags & FLAG_ARCHIVED) {
             r = objectstore_put(as->mailbox, &record, destfname);   // put should just add the refcount.
@@ -1436,3 +1469,18 @@ EXPORTED const char *append_stagefname(struct stagemsg *stage)
 {
     return strarray_nth(&stage->parts, 0);
 }
+
+/* returns the name of stage part 'i', or NULL if there are fewer */
+EXPORTED const char *append_stagepart(struct stagemsg *stage, int i)
+{
+    if (i >= stage->parts.count) return NULL;
+    return strarray_nth(&stage->parts, i);
+}
+
+/* record the GUID of the staged message, if it was calculated while
+ * writing it, so that append_fromstage() needn't hash it again */
+EXPORTED void append_setstageguid(struct stagemsg *stage,
+                                  const struct message_guid *guid)
+{
+    message_guid_copy(&stage->guid, guid);
+}
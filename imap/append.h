@@ -144,5 +144,9 @@ extern int append_run_annotator(struct appendstate *as,
                                 struct index_record *record);
 
 extern const char *append_stagefname(struct stagemsg *stage);
+extern const char *append_stagepart(struct stagemsg *stage, int i);
+extern int append_preparestage(struct stagemsg *stage, const char *mboxname);
+extern void append_setstageguid(struct stagemsg *stage,
+                                const struct message_guid *guid);
 
 #endif /* INCLUDED_APPEND_H */
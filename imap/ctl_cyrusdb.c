@@ -78,6 +78,7 @@
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
 #include "seen.h"
+#include "sortcache.h"
 #include "statuscache.h"
 #include "tls.h"
 #include "util.h"
@@ -99,6 +100,7 @@ static struct cyrusdb {
     { FNAME_TLSSESSIONS,        &config_tls_sessions_db,NULL,   0 },
     { FNAME_PTSDB,              &config_ptscache_db,    NULL,   0 },
     { FNAME_STATUSCACHEDB,      &config_statuscache_db, NULL,   0 },
+    { FNAME_SORTCACHEDB,        &config_sortcache_db,   NULL,   0 },
     { NULL,                     NULL,                   NULL,   0 }
 };
 
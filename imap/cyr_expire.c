@@ -61,6 +61,7 @@
 #include "global.h"
 #include "hash.h"
 #include "libcyr_cfg.h"
+#include "mailbox.h"
 #include "mboxevent.h"
 #include "mboxlist.h"
 #include "conversations.h"
@@ -446,6 +447,23 @@ done:
     return 0;
 }
 
+/*
+ * config_foreachoverflowstring() callback function to find partition-
+ * and archivepartition- options and purge their GUID stores
+ */
+static void purge_guidstore(const char *key, const char *val, void *rock)
+{
+    unsigned *nremoved = (unsigned *) rock;
+
+    if (sigquit) return;
+
+    if (!strncmp("archive", key, 7)) key += 7;
+    if (strncmp("partition-", key, 10)) return;
+
+    if (mailbox_guidstore_purge(val, nremoved))
+        syslog(LOG_ERR, "IOERROR: purging GUID store on %s", val);
+}
+
 static void sighandler (int sig __attribute((unused)))
 {
     sigquit = 1;
@@ -657,6 +675,23 @@ int main(int argc, char *argv[])
         goto finish;
     }
 
+    /* drop stored message files which expunges have left unreferenced */
+    if (do_expunge && !do_user && !find_prefix &&
+        config_getswitch(IMAPOPT_SINGLEINSTANCESTORE_GUID)) {
+        unsigned nremoved = 0;
+
+        config_foreachoverflowstring(purge_guidstore, &nremoved);
+
+        syslog(LOG_NOTICE, "Removed %u unreferenced files from GUID stores",
+               nremoved);
+        if (verbose)
+            fprintf(stderr, "Removed %u unreferenced files from GUID stores\n",
+                    nremoved);
+    }
+    if (sigquit) {
+        goto finish;
+    }
+
     if (do_cid_expire) {
         cid_expire_seconds = config_getint(IMAPOPT_CONVERSATIONS_EXPIRE_DAYS) * 86400;
         crock.expire_mark = time(0) - cid_expire_seconds;
@@ -188,14 +188,25 @@ EXPORTED const char *dlist_reserve_path(const char *part, int isarchive,
     return buf;
 }
 
+/*
+ * Read a file literal of 'size' bytes into the reserve area.  The data
+ * is hashed on the way, and '*verified' is set if it matches 'guid', so
+ * that the GUID needn't be calculated again when the file is parsed.
+ * A mismatch is not an error here: the file is still kept, and is
+ * rejected when it's parsed for an append (see sync_append_copyfile).
+ */
 static int reservefile(struct protstream *in, const char *part,
                        struct message_guid *guid, unsigned long size,
-                       const char **fname)
+                       const char **fname, int *verified)
 {
     FILE *file;
     char buf[8192+1];
+    struct message_guid_ctx guidctx;
+    struct message_guid guid2;
     int r = 0, n;
 
+    *verified = 0;
+
     /* XXX - write to a temporary file then move in to place! */
     *fname = dlist_reserve_path(part, /*isarchive*/0, guid);
 
@@ -210,7 +221,8 @@ static int reservefile(struct protstream *in, const char *part,
          * to avoid losing protocol sync */
     }
 
-    /* XXX - calculate sha1 on the fly? */
+    message_guid_init(&guidctx);
+
     while (size) {
         n = prot_read(in, buf, size > 8192 ? 8192 : size);
         if (!n) {
@@ -220,12 +232,17 @@ static int reservefile(struct protstream *in, const char *part,
             break;
         }
         size -= n;
-        if (!r) fwrite(buf, 1, n, file);
+        if (!r) {
+            message_guid_update(&guidctx, buf, n);
+            fwrite(buf, 1, n, file);
+        }
     }
 
     if (r)
         goto error;
 
+    message_guid_final(&guidctx, &guid2);
+
     /* Make sure that message flushed to disk just incase mmap has problems */
     fflush(file);
     if (ferror(file)) {
@@ -240,6 +257,8 @@ static int reservefile(struct protstream *in, const char *part,
 
     fclose(file);
 
+    *verified = message_guid_equal(&guid2, guid);
+
     return 0;
 
 error:
@@ -283,14 +302,21 @@ void dlist_unstitch(struct dlist *parent, struct dlist *child)
     else parent->head = child->next;
 
     if (parent->tail == child) parent->tail = prev;
+    parent->hint = NULL;
 
     child->next = NULL;
 }
 
 static struct dlist *dlist_child(struct dlist *dl, const char *name)
 {
-    struct dlist *i = xzmalloc(sizeof(struct dlist));
-    if (name) i->name = xstrdup(name);
+    /* keep the name with the node: a replica applying a large mailbox
+     * holds millions of these, so save the extra allocation */
+    size_t namelen = name ? strlen(name) + 1 : 0;
+    struct dlist *i = xzmalloc(sizeof(struct dlist) + namelen);
+    if (name) {
+        i->name = (char *)(i + 1);
+        memcpy(i->name, name, namelen);
+    }
     i->type = DL_NIL;
     if (dl)
         dlist_stitch(dl, i);
@@ -311,7 +337,7 @@ static void _dlist_free_children(struct dlist *dl)
         i = next;
     }
 
-    dl->head = dl->tail = NULL;
+    dl->head = dl->tail = dl->hint = NULL;
 }
 
 static void _dlist_clean(struct dlist *dl)
@@ -329,6 +355,7 @@ static void _dlist_clean(struct dlist *dl)
     free(dl->gval);
     dl->gval = NULL;
     dl->nval = 0;
+    dl->verified = 0;
 }
 
 
@@ -712,7 +739,6 @@ EXPORTED void dlist_free(struct dlist **dlp)
 {
     if (!*dlp) return;
     _dlist_clean(*dlp);
-    free((*dlp)->name);
     free(*dlp);
     *dlp = NULL;
 }
@@ -982,8 +1008,12 @@ EXPORTED char dlist_parse(struct dlist **dlp, unsigned int flags, struct protstr
                 dl = dlist_setsfile(NULL, kbuf.s, pbuf.s, &tmp_guid, sbuf.s, sbuf.len);
             }
             else {
-                if (reservefile(in, pbuf.s, &tmp_guid, size, &fname)) goto fail;
+                int verified;
+
+                if (reservefile(in, pbuf.s, &tmp_guid, size, &fname, &verified))
+                    goto fail;
                 dl = dlist_setfile(NULL, kbuf.s, pbuf.s, &tmp_guid, size, fname);
+                dl->verified = verified;
             }
             /* file literal */
         }
@@ -1058,16 +1088,28 @@ EXPORTED int dlist_parsemap(struct dlist **dlp, unsigned int flags,
 
 EXPORTED struct dlist *dlist_getchild(struct dlist *dl, const char *name)
 {
-    struct dlist *i;
+    struct dlist *i, *start;
 
     if (!dl) return NULL;
 
-    for (i = dl->head; i; i = i->next) {
+    /* keys are usually read in the order they were sent, so carry on
+     * from the last match, and only then look at the ones before it */
+    start = dl->hint ? dl->hint->next : NULL;
+
+    for (i = start; i; i = i->next) {
         if (i->name && !strcmp(name, i->name))
-            return i;
+            goto found;
+    }
+    for (i = dl->head; i != start; i = i->next) {
+        if (i->name && !strcmp(name, i->name))
+            goto found;
     }
     lastkey = name;
     return NULL;
+
+found:
+    dl->hint = i;
+    return i;
 }
 
 EXPORTED struct dlist *dlist_getchildn(struct dlist *dl, int num)
@@ -1091,6 +1133,7 @@ EXPORTED struct dlist *dlist_splice(struct dlist *dl, int num)
     /* clone exact type */
     ret->type = dl->type;
     ret->nval = dl->nval;
+    dl->hint = NULL;
 
     if (num > 0) {
         struct dlist *end = dlist_getchildn(dl, num - 1);
@@ -1126,6 +1169,7 @@ EXPORTED void dlist_splat(struct dlist *parent, struct dlist *child)
     }
 
     assert(replace);
+    parent->hint = NULL;
 
     if (child->head) {
         /* stitch in children */
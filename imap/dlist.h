@@ -101,6 +101,8 @@ struct dlist {
     bit64 nval;
     struct message_guid *gval; /* guid if any */
     char *part; /* so what if we're big! */
+    int verified; /* file contents were hashed to gval on upload */
+    struct dlist *hint; /* child found by the last dlist_getchild() */
 };
 
 const char *dlist_reserve_path(const char *part, int isarchive, const struct message_guid *guid);
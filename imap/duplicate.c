@@ -101,7 +101,8 @@ EXPORTED int duplicate_init(const char *fname)
         fname = tofree;
     }
 
-    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &dupdb);
+    /* losing the last mark after a crash just lets one duplicate through */
+    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE|CYRUSDB_LAZYCOMMIT, &dupdb);
     if (r != 0) {
         syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
                cyrusdb_strerror(r));
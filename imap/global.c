@@ -76,6 +76,7 @@
 #include "userdeny.h"
 #include "util.h"
 #include "xmalloc.h"
+#include "xstats.h"
 #include "xstrlcpy.h"
 
 /* generated headers are not necessarily in current directory */
@@ -105,6 +106,7 @@ EXPORTED const char *config_duplicate_db;
 EXPORTED const char *config_tls_sessions_db;
 EXPORTED const char *config_ptscache_db;
 EXPORTED const char *config_statuscache_db;
+EXPORTED const char *config_sortcache_db;
 HIDDEN const char *config_userdeny_db;
 EXPORTED const char *config_zoneinfo_db;
 EXPORTED const char *config_conversations_db;
@@ -116,6 +118,23 @@ static int session_id_count = 0;
 
 static strarray_t *suppressed_capabilities = NULL;
 
+static void cyrusdb_timer(enum cyrusdb_timer_op op,
+                          const struct timeval *start)
+{
+    static const int timers[] = {
+        [CYRUSDB_TIMER_OPEN] = XSTATS_TIMER_CYRUSDB_OPEN,
+        [CYRUSDB_TIMER_FETCH] = XSTATS_TIMER_CYRUSDB_FETCH,
+        [CYRUSDB_TIMER_FETCHLOCK] = XSTATS_TIMER_CYRUSDB_FETCHLOCK,
+        [CYRUSDB_TIMER_FETCHNEXT] = XSTATS_TIMER_CYRUSDB_FETCHNEXT,
+        [CYRUSDB_TIMER_CREATE] = XSTATS_TIMER_CYRUSDB_CREATE,
+        [CYRUSDB_TIMER_STORE] = XSTATS_TIMER_CYRUSDB_STORE,
+        [CYRUSDB_TIMER_DELETE] = XSTATS_TIMER_CYRUSDB_DELETE,
+        [CYRUSDB_TIMER_COMMIT] = XSTATS_TIMER_CYRUSDB_COMMIT
+    };
+
+    xstats_timer_add(timers[op], start);
+}
+
 static int get_facility(const char *name)
 {
     if (!strcasecmp(name, "DAEMON"))
@@ -270,6 +289,7 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
         config_tls_sessions_db = config_getstring(IMAPOPT_TLS_SESSIONS_DB);
         config_ptscache_db = config_getstring(IMAPOPT_PTSCACHE_DB);
         config_statuscache_db = config_getstring(IMAPOPT_STATUSCACHE_DB);
+        config_sortcache_db = config_getstring(IMAPOPT_SORTCACHE_DB);
         config_userdeny_db = config_getstring(IMAPOPT_USERDENY_DB);
         config_zoneinfo_db = config_getstring(IMAPOPT_ZONEINFO_DB);
         config_conversations_db = config_getstring(IMAPOPT_CONVERSATIONS_DB);
@@ -314,9 +334,16 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
                                   config_getswitch(IMAPOPT_SQL_USESSL));
         libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
                                   config_getswitch(IMAPOPT_SKIPLIST_ALWAYS_CHECKPOINT));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_LAZY_COMMIT,
+                                  config_getswitch(IMAPOPT_TWOSKIP_LAZY_COMMIT));
+        libcyrus_config_setint(CYRUSOPT_COMPRESS_LEVEL,
+                               config_getint(IMAPOPT_COMPRESS_LEVEL));
 
         /* Not until all configuration parameters are set! */
         libcyrus_init();
+
+        if (config_getswitch(IMAPOPT_CYRUSDB_TIMERS))
+            cyrusdb_settimer(cyrusdb_timer);
     }
 
     return 0;
@@ -144,6 +144,7 @@ extern const char *config_duplicate_db;
 extern const char *config_tls_sessions_db;
 extern const char *config_ptscache_db;
 extern const char *config_statuscache_db;
+extern const char *config_sortcache_db;
 extern const char *config_userdeny_db;
 extern const char *config_zoneinfo_db;
 extern const char *config_conversations_db;
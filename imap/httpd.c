@@ -94,6 +94,7 @@
 #include "tok.h"
 #include "wildmat.h"
 #include "md5.h"
+#include "xstats.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -955,6 +956,8 @@ static void cmdloop(void)
         const struct namespace_t *namespace;
         const struct method_t *meth_t;
         struct request_line_t *req_line = &txn.req_line;
+        struct timeval reqstart;
+        int timed = 0;
 
         /* Reset txn state */
         txn.meth = METH_UNKNOWN;
@@ -1036,6 +1039,9 @@ static void cmdloop(void)
         /* Ignore 1 empty line before request-line per RFC 7230 Sec 3.5 */
         if (!empty++ && !*req_line->buf) goto req_line;
 
+        gettimeofday(&reqstart, NULL);
+        timed = 1;
+
         /* Parse request-line = method SP request-target SP HTTP-version CRLF */
         tok_initm(&tok, req_line->buf, " ", 0);
         if (!(req_line->meth = tok_next(&tok))) {
@@ -1489,6 +1495,12 @@ static void cmdloop(void)
         /* Handle errors (success responses handled by method functions) */
         if (ret) error_response(ret, &txn);
 
+        if (timed) {
+            xstats_namedtimer_stop("http", txn.meth == METH_UNKNOWN ?
+                                   "unknown" : http_methods[txn.meth].name,
+                                   &reqstart);
+        }
+
         /* Read and discard any unread request body */
         if (!(txn.flags.conn & CONN_CLOSE)) {
             txn.req_body.flags |= BODY_DISCARD;
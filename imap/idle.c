@@ -58,7 +58,9 @@
 #include "idle.h"
 #include "idlemsg.h"
 #include "global.h"
+#include "strarray.h"
 #include "util.h"
+#include "xmalloc.h"
 
 HIDDEN const char *idle_method_desc = "no";
 
@@ -69,6 +71,12 @@ static struct sockaddr_un idle_remote;
  * that we want to be notified of changes */
 static int idle_started;
 
+/* the mailbox passed to idle_start(), and the other mailboxes
+ * being watched, with those reported as changed by idle_wait() */
+static char *idle_mboxname;
+static strarray_t idle_others = STRARRAY_INITIALIZER;
+static strarray_t idle_changed = STRARRAY_INITIALIZER;
+
 /* Send the message 'which' about the mailbox 'mboxname' to the idled.
  * Returns 0 on success or an IMAP error code on failure */
 static int idle_send_msg(int which, const char *mboxname)
@@ -171,6 +179,35 @@ EXPORTED void idle_start(const char *mboxname)
     }
 
     idle_started = 1;
+    idle_mboxname = xstrdup(mboxname ? mboxname : ".");
+}
+
+EXPORTED void idle_start_others(const strarray_t *mboxnames)
+{
+    int i, r;
+
+    if (!idle_started) return;
+
+    for (i = 0; i < mboxnames->count; i++) {
+        const char *mboxname = strarray_nth(mboxnames, i);
+
+        if (!strcmp(mboxname, idle_mboxname)) continue;
+
+        r = idle_send_msg(IDLE_MSG_INIT, mboxname);
+        if (r) {
+            syslog(LOG_ERR, "IDLE: error sending message "
+                            "INIT to idled for mailbox %s: %s.",
+                            mboxname, error_message(r));
+            continue;
+        }
+
+        strarray_append(&idle_others, mboxname);
+    }
+}
+
+EXPORTED const strarray_t *idle_changed_others(void)
+{
+    return &idle_changed;
 }
 
 EXPORTED int idle_wait(int otherfd)
@@ -185,6 +222,8 @@ EXPORTED int idle_wait(int otherfd)
 
     if (!idle_enabled()) return 0;
 
+    strarray_truncate(&idle_changed, 0);
+
     /* If idled was not contacted, we still listen on the socket,
      * because we might get ALERTs, but we won't get mailbox
      * notifications.  The poll timeout controls how quickly
@@ -229,7 +268,13 @@ EXPORTED int idle_wait(int otherfd)
             if (idle_recv(&from, &msg)) {
                 switch (msg.which) {
                 case IDLE_MSG_NOTIFY:
-                    flags |= IDLE_MAILBOX;
+                    if (idle_others.count &&
+                        strcmp(msg.mboxname, idle_mboxname)) {
+                        strarray_add(&idle_changed, msg.mboxname);
+                        flags |= IDLE_OTHERMAILBOX;
+                    }
+                    else
+                        flags |= IDLE_MAILBOX;
                     break;
                 case IDLE_MSG_ALERT:
                     flags |= IDLE_ALERT;
@@ -246,10 +291,19 @@ EXPORTED int idle_wait(int otherfd)
 
 EXPORTED void idle_stop(const char *mboxname)
 {
-    int r;
+    int i, r;
 
     if (!idle_started) return;
 
+    for (i = 0; i < idle_others.count; i++) {
+        /* errors were logged by the INIT already */
+        idle_send_msg(IDLE_MSG_DONE, strarray_nth(&idle_others, i));
+    }
+    strarray_fini(&idle_others);
+    strarray_fini(&idle_changed);
+    free(idle_mboxname);
+    idle_mboxname = NULL;
+
     /* Tell idled that we're done idling */
     r = idle_send_msg(IDLE_MSG_DONE, mboxname);
     if (r && (r != ENOENT)) {
@@ -43,6 +43,7 @@
 #define IDLE_H
 
 #include "mailbox.h"
+#include "strarray.h"
 
 extern const char *idle_method_desc;
 
@@ -55,7 +56,10 @@ typedef enum {
     IDLE_ALERT =        0x2,
     /* input was detected on the @otherfd, probably because the IMAP
      * client cancelled the IDLE */
-    IDLE_INPUT =        0x4
+    IDLE_INPUT =        0x4,
+    /* one of the mailboxes passed to idle_start_others() may have
+     * changed, see idle_changed_others() */
+    IDLE_OTHERMAILBOX = 0x8
 } idle_flags_t;
 
 typedef void idle_updateproc_t(idle_flags_t flags);
@@ -69,6 +73,12 @@ int idle_enabled(void);
 /* Start IDLEing on 'mailbox'. */
 void idle_start(const char *mboxname);
 
+/* Also watch the mailboxes in 'mboxnames' until idle_stop() */
+void idle_start_others(const strarray_t *mboxnames);
+
+/* The other mailboxes reported as changed by the last idle_wait() */
+const strarray_t *idle_changed_others(void);
+
 /* Wait for something to happen while IDLEing.  @otherfd is a file
  * descriptor on which to wait for input; presumably this will be the
  * fd of the main protstream from the IMAP client.  Returns a mask of
@@ -54,6 +54,7 @@
 #endif
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/time.h>
 
 #include "idlemsg.h"
 #include "global.h"
@@ -76,6 +77,19 @@ struct ientry {
 };
 static struct hash_table itable;
 
+/* mailboxes with a NOTIFY waiting to be forwarded, in order of arrival */
+struct pentry {
+    char *mboxname;
+    struct timeval due;
+    struct pentry *next;
+};
+static struct pentry *pending_head, *pending_tail;
+static struct hash_table ptable;
+static int notify_delay;        /* milliseconds */
+
+/* counters, logged on shutdown */
+static unsigned long notify_received, notify_coalesced, notify_sent;
+
 EXPORTED void fatal(const char *msg, int err)
 {
     if (debugmode) fprintf(stderr, "dying with %s %d\n",msg,err);
@@ -127,11 +141,114 @@ static void remove_ientry(const char *mboxname,
 
 
 
-static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
+/* send a NOTIFY for mboxname to all clients idling on it */
+static void notify_idlers(const char *mboxname)
 {
     struct ientry *t, *n;
+    idle_message_t msg;
     int r;
 
+    msg.which = IDLE_MSG_NOTIFY;
+    strncpy(msg.mboxname, mboxname, sizeof(msg.mboxname));
+    msg.mboxname[sizeof(msg.mboxname)-1] = '\0';
+
+    t = (struct ientry *) hash_lookup(mboxname, &itable);
+    for ( ; t ; t = n) {
+        n = t->next;
+        if ((t->itime + idle_timeout) < time(NULL)) {
+            /* This process has been idling for longer than the timeout
+             * period, so it probably died.  Remove it from the list.
+             */
+            if (verbose || debugmode)
+                syslog(LOG_DEBUG, "    TIMEOUT %s\n", idle_id_from_addr(&t->remote));
+
+            remove_ientry(mboxname, &t->remote);
+        }
+        else { /* signal process to update */
+            if (verbose || debugmode)
+                syslog(LOG_DEBUG, "    fwd NOTIFY %s\n", idle_id_from_addr(&t->remote));
+
+            /* forward the received msg onto our clients */
+            r = idle_send(&t->remote, &msg);
+            if (r) {
+                /* ENOENT can happen as result of a race between delivering
+                 * messages and shutting down imapd.  It indicates that the
+                 * imapd's socket was unlinked, which means that imapd went
+                 * through it's graceful shutdown path, so don't syslog. */
+                if (r != ENOENT)
+                    syslog(LOG_ERR, "IDLE: error sending message "
+                                    "NOTIFY to imapd %s for mailbox %s: %s, "
+                                    "forgetting.",
+                                    idle_id_from_addr(&t->remote),
+                                    mboxname, error_message(r));
+                if (verbose || debugmode)
+                    syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&t->remote));
+                remove_ientry(mboxname, &t->remote);
+            }
+            else notify_sent++;
+        }
+    }
+}
+
+/* queue a NOTIFY for mboxname, unless one is already waiting */
+static void add_pending(const char *mboxname)
+{
+    struct pentry *p;
+
+    if (hash_lookup(mboxname, &ptable)) {
+        notify_coalesced++;
+        return;
+    }
+
+    p = xzmalloc(sizeof(struct pentry));
+    p->mboxname = xstrdup(mboxname);
+    gettimeofday(&p->due, NULL);
+    p->due.tv_sec += notify_delay / 1000;
+    p->due.tv_usec += (notify_delay % 1000) * 1000;
+    if (p->due.tv_usec >= 1000000) {
+        p->due.tv_sec++;
+        p->due.tv_usec -= 1000000;
+    }
+
+    if (pending_tail) pending_tail->next = p;
+    else pending_head = p;
+    pending_tail = p;
+
+    hash_insert(mboxname, p, &ptable);
+}
+
+/* forward the queued NOTIFYs which are due, and return the time
+ * until the next one is, capped at 'timeout' */
+static void flush_pending(struct timeval *timeout)
+{
+    struct timeval now;
+    struct pentry *p;
+
+    gettimeofday(&now, NULL);
+
+    while ((p = pending_head) && timercmp(&p->due, &now, <=)) {
+        pending_head = p->next;
+        if (!pending_head) pending_tail = NULL;
+
+        hash_del(p->mboxname, &ptable);
+        notify_idlers(p->mboxname);
+
+        free(p->mboxname);
+        free(p);
+    }
+
+    if (pending_head) {
+        struct timeval wait;
+
+        timersub(&pending_head->due, &now, &wait);
+        if (timercmp(&wait, timeout, <)) *timeout = wait;
+    }
+}
+
+static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
+{
+    struct ientry *t, *n;
+
     switch (msg->which) {
     case IDLE_MSG_INIT:
         if (verbose || debugmode)
@@ -151,42 +268,18 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
         if (verbose || debugmode)
             syslog(LOG_DEBUG, "IDLE_MSG_NOTIFY '%s'\n", msg->mboxname);
 
-        /* send a message to all clients idling on mboxname */
-        t = (struct ientry *) hash_lookup(msg->mboxname, &itable);
-        for ( ; t ; t = n) {
-            n = t->next;
-            if ((t->itime + idle_timeout) < time(NULL)) {
-                /* This process has been idling for longer than the timeout
-                 * period, so it probably died.  Remove it from the list.
-                 */
-                if (verbose || debugmode)
-                    syslog(LOG_DEBUG, "    TIMEOUT %s\n", idle_id_from_addr(&t->remote));
+        notify_received++;
 
-                remove_ientry(msg->mboxname, &t->remote);
-            }
-            else { /* signal process to update */
-                if (verbose || debugmode)
-                    syslog(LOG_DEBUG, "    fwd NOTIFY %s\n", idle_id_from_addr(&t->remote));
-
-                /* forward the received msg onto our clients */
-                r = idle_send(&t->remote, msg);
-                if (r) {
-                    /* ENOENT can happen as result of a race between delivering
-                     * messages and shutting down imapd.  It indicates that the
-                     * imapd's socket was unlinked, which means that imapd went
-                     * through it's graceful shutdown path, so don't syslog. */
-                    if (r != ENOENT)
-                        syslog(LOG_ERR, "IDLE: error sending message "
-                                        "NOTIFY to imapd %s for mailbox %s: %s, "
-                                        "forgetting.",
-                                        idle_id_from_addr(&t->remote),
-                                        msg->mboxname, error_message(r));
-                    if (verbose || debugmode)
-                        syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&t->remote));
-                    remove_ientry(msg->mboxname, &t->remote);
-                }
-            }
-        }
+        /* nobody to tell */
+        if (!hash_lookup(msg->mboxname, &itable))
+            break;
+
+        /* send a message to all clients idling on mboxname, either
+         * now or once the notify delay has passed */
+        if (notify_delay)
+            add_pending(msg->mboxname);
+        else
+            notify_idlers(msg->mboxname);
         break;
 
     case IDLE_MSG_DONE:
@@ -250,6 +343,9 @@ static void send_alert(const char *key,
 static void shut_down(int ec) __attribute__((noreturn));
 static void shut_down(int ec)
 {
+    syslog(LOG_NOTICE, "IDLE: %lu notifications received, %lu coalesced, "
+           "%lu forwarded", notify_received, notify_coalesced, notify_sent);
+
     hash_enumerate(&itable, send_alert, NULL);
     idle_done_sock();
     cyrus_done();
@@ -294,6 +390,9 @@ int main(int argc, char **argv)
     if (idle_timeout < 30) idle_timeout = 30;
     idle_timeout *= 60;
 
+    notify_delay = config_getint(IMAPOPT_IDLED_NOTIFY_DELAY);
+    if (notify_delay < 0) notify_delay = 0;
+
     /* count the number of mailboxes */
     mboxlist_init(0);
     mboxlist_open(NULL);
@@ -306,6 +405,7 @@ int main(int argc, char **argv)
 
     /* create idle table -- +1 to avoid a zero value */
     construct_hash_table(&itable, nmbox + 1, 1);
+    construct_hash_table(&ptable, 1024, 1);
 
     if (!idle_make_server_address(&local) ||
         !idle_init_sock(&local)) {
@@ -349,9 +449,10 @@ int main(int argc, char **argv)
             shut_down(1);
         }
 
-        /* timeout for select is 1 second */
+        /* timeout for select is 1 second, or less if a notify is due */
         timeout.tv_sec = 1;
         timeout.tv_usec = 0;
+        flush_pending(&timeout);
 
         /* check for the next input */
         rset = read_set;
@@ -44,6 +44,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -101,6 +104,7 @@
 #include "proc.h"
 #include "quota.h"
 #include "seen.h"
+#include "sortcache.h"
 #include "statuscache.h"
 #include "sync_log.h"
 #include "sync_support.h"
@@ -223,6 +227,9 @@ struct namespace imapd_namespace;
 /* track if we're idling */
 static int idling = 0;
 
+/* other mailboxes to report changes to while idling, from XNOTIFY SET */
+static strarray_t notify_mboxes = STRARRAY_INITIALIZER;
+
 static const struct mbox_name_attribute {
     int flag;
     const char *id;
@@ -431,6 +438,8 @@ static void cmd_xrunannotator(const char *tag, const char *sequence,
 static void cmd_xwarmup(const char *tag);
 
 static void cmd_enable(char* tag);
+static void cmd_xnotify(char *tag);
+static void notify_status(const strarray_t *mboxnames);
 
 static void cmd_syncget(const char *tag, struct dlist *kl);
 static void cmd_syncapply(const char *tag, struct dlist *kl,
@@ -895,6 +904,10 @@ int service_init(int argc, char **argv, char **envp)
         statuscache_open();
     }
 
+    if (config_getswitch(IMAPOPT_SORTCACHE)) {
+        sortcache_open();
+    }
+
     /* Create a protgroup for input from the client and selected backend */
     protin = protgroup_new(2);
 
@@ -934,6 +947,7 @@ int service_main(int argc __attribute__((unused)),
 #endif
 
     sync_log_init();
+    sync_log_buffer();
 
     imapd_in = prot_new(0, 0);
     imapd_out = prot_new(1, 1);
@@ -1106,6 +1120,10 @@ void shut_down(int code)
         statuscache_done();
     }
 
+    if (config_getswitch(IMAPOPT_SORTCACHE)) {
+        sortcache_close();
+    }
+
     partlist_local_done();
 
     if (imapd_in) {
@@ -1195,6 +1213,40 @@ static void imapd_check(struct backend *be, int usinguid)
     }
 }
 
+/*
+ * Map a (lower case) command name onto the name of its command timer.
+ * Only the commands we know get a timer of their own, so clients can't
+ * fill the timer table with made up names.
+ */
+static const char *imapd_timername(const char *cmdname)
+{
+    static const char * const cmds[] = {
+        "append", "authenticate", "capability", "check", "close",
+        "compress", "copy", "create", "delete", "deleteacl", "dump",
+        "enable", "examine", "expunge", "fetch", "genurlauth", "getacl",
+        "getannotation", "getmetadata", "getquota", "getquotaroot", "id",
+        "idle", "list", "listrights", "localappend", "localcreate",
+        "localdelete", "login", "logout", "lsub", "move", "mupdatepush",
+        "myrights", "namespace", "noop", "reconstruct", "rename",
+        "resetkey", "rlist", "rlsub", "scan", "search", "select", "setacl",
+        "setannotation", "setmetadata", "setquota", "sort", "starttls",
+        "status", "store", "subscribe", "syncapply", "syncget",
+        "syncrestart", "thread", "uid", "undump", "unselect", "unsubscribe",
+        "urlfetch", "xapplepushservice", "xconvfetch", "xconvmeta",
+        "xconvmultisort", "xconvsort", "xconvupdates", "xfer", "xforever",
+        "xkillmy", "xlist", "xmeid", "xmove", "xnotify", "xrunannotator",
+        "xsnippets", "xstats", "xwarmup", NULL
+    };
+    int i;
+
+    for (i = 0; cmds[i]; i++) {
+        if (!strcmp(cmdname, cmds[i]))
+            return cmds[i];
+    }
+
+    return "unknown";
+}
+
 /*
  * Top-level command loop parsing
  */
@@ -1207,6 +1259,7 @@ static void cmdloop(void)
     const char *err;
     const char * commandmintimer;
     double commandmintimerd = 0.0;
+    struct timeval cmdstart;
     struct sync_reserve_list *reserve_list =
         sync_reserve_list_create(SYNC_MESSAGE_LIST_HASH_SIZE);
 #ifdef ENABLE_APPLEPUSHSERVICE
@@ -1240,6 +1293,9 @@ static void cmdloop(void)
         /* Release any held index */
         index_release(imapd_index);
 
+        /* Write out the last command's sync log entries */
+        sync_log_flush();
+
         /* Flush any buffered output */
         prot_flush(imapd_out);
         if (backend_current) prot_flush(backend_current->out);
@@ -1316,6 +1372,7 @@ static void cmdloop(void)
 
         /* Start command timer */
         cmdtime_starttimer();
+        xstats_timer_start(&cmdstart);
 
         /* note that about half the commands (the common ones that don't
            hit the mailboxes file) now close the mailboxes file just in
@@ -1596,6 +1653,13 @@ static void cmdloop(void)
             else if (!strcmp(cmd.s, "Idle") && idle_enabled()) {
                 if (c == '\r') c = prot_getc(imapd_in);
                 if (c != '\n') goto extraargs;
+
+                /* don't keep large arguments of earlier commands
+                 * around for the lifetime of the IDLE */
+                buf_free(&arg1);
+                buf_free(&arg2);
+                buf_free(&arg3);
+
                 cmd_idle(tag.s);
 
                 snmp_increment(IDLE_COUNT, 1);
@@ -2285,6 +2349,12 @@ static void cmdloop(void)
             else if (!strcmp(cmd.s, "Xstats")) {
                 cmd_xstats(tag.s, c);
             }
+            else if (!strcmp(cmd.s, "Xnotify") && idle_enabled() &&
+                     config_getswitch(IMAPOPT_IMAPNOTIFY)) {
+                if (c != ' ') goto missingargs;
+
+                cmd_xnotify(tag.s);
+            }
             else if (!strcmp(cmd.s, "Xwarmup")) {
                 /* XWARMUP doesn't need a mailbox to be selected */
                 if (c != ' ') goto missingargs;
@@ -2379,6 +2449,9 @@ static void cmdloop(void)
         }
 
         /* End command timer - don't log "idle" commands */
+        if (strcmp("idle", cmdname))
+            xstats_namedtimer_stop("imap", imapd_timername(cmdname),
+                                   &cmdstart);
         if (commandmintimer && strcmp("idle", cmdname)) {
             double cmdtime, nettime;
             const char *mboxname = index_mboxname(imapd_index);
@@ -3038,6 +3111,26 @@ static void cmd_id(char *tag)
     imapd_id.did_id = 1;
 }
 
+/*
+ * Return the memory freed after the last command to the system
+ * before sleeping in IDLE, which is where most connections spend
+ * most of their lifetime.  This is done once on entering IDLE:
+ * the updates sent while idling allocate little, and trimming the
+ * heap after each of them would cost more than it returns.
+ */
+static void imapd_idle_trim(void)
+{
+    /* nothing to hold onto from the last command */
+    if (global_conversations) {
+        conversations_abort(&global_conversations);
+        global_conversations = NULL;
+    }
+
+#ifdef HAVE_MALLOC_TRIM
+    malloc_trim(0);
+#endif
+}
+
 /*
  * Perform an IDLE command
  */
@@ -3057,11 +3150,13 @@ static void cmd_idle(char *tag)
         /* Start doing mailbox updates */
         index_check(imapd_index, 1, 0);
         idle_start(index_mboxname(imapd_index));
+        idle_start_others(&notify_mboxes);
         /* use this flag so if getc causes a shutdown due to
          * connection abort we tell idled about it */
         idling = 1;
 
         index_release(imapd_index);
+        imapd_idle_trim();
         while ((flags = idle_wait(imapd_in->fd))) {
             if (flags & IDLE_INPUT) {
                 /* Get continuation data */
@@ -3073,6 +3168,9 @@ static void cmd_idle(char *tag)
             if (flags & IDLE_MAILBOX)
                 index_check(imapd_index, 1, 0);
 
+            if (flags & IDLE_OTHERMAILBOX)
+                notify_status(idle_changed_others());
+
             if (flags & IDLE_ALERT) {
                 char shut[MAX_MAILBOX_PATH+1];
                 if (! imapd_userisadmin &&
@@ -3249,6 +3347,8 @@ static void capa_response(int flags)
 
     if (idle_enabled()) {
         prot_printf(imapd_out, " IDLE");
+        if (config_getswitch(IMAPOPT_IMAPNOTIFY))
+            prot_printf(imapd_out, " XNOTIFY");
     }
 }
 
@@ -3768,7 +3868,13 @@ static void cmd_append(char *tag, char *name, const char *cur_name)
             if (r) goto done;
 
             /* Copy message to stage */
-            r = message_copy_strict(imapd_in, curstage->f, size, curstage->binary);
+            struct message_guid guid;
+
+            r = message_copy_strict(imapd_in, curstage->f, size,
+                                    curstage->binary, &guid);
+            /* BINARY stages are re-encoded, so their GUID changes */
+            if (!r && !curstage->binary)
+                append_setstageguid(curstage->stage, &guid);
         }
         qdiffs[QUOTA_STORAGE] += size;
         /* If this is a non-BINARY message, close the stage file.
@@ -5947,6 +6053,18 @@ error:
     goto out;
 }
 
+static void xstats_print_timer(const char *name, struct xstats_timer *t,
+                               void *rock __attribute__((unused)))
+{
+    int i;
+
+    prot_printf(imapd_out, "* XTIMER %s %u %llu %u (", name, t->count,
+                (unsigned long long)t->total, t->max);
+    for (i = 0 ; i < XSTATS_TIMER_BUCKETS ; i++)
+        prot_printf(imapd_out, "%s%u", i ? " " : "", t->buckets[i]);
+    prot_printf(imapd_out, ")\r\n");
+}
+
 static void cmd_xstats(char *tag, int c)
 {
     int metric;
@@ -5978,6 +6096,8 @@ static void cmd_xstats(char *tag, int c)
         prot_printf(imapd_out, " %s %u", xstats_names[metric], xstats[metric]);
     prot_printf(imapd_out, "\r\n");
 
+    xstats_timer_foreach(xstats_print_timer, NULL);
+
     prot_printf(imapd_out, "%s OK %s\r\n", tag,
                 error_message(IMAP_OK_COMPLETED));
     return;
@@ -13422,6 +13542,177 @@ static void cmd_enable(char *tag)
                 error_message(IMAP_OK_COMPLETED));
 }
 
+static int notify_addmbox_cb(const mbentry_t *mbentry, void *rock)
+{
+    strarray_t *mboxes = (strarray_t *) rock;
+
+    if (mbentry->mbtype & (MBTYPE_REMOTE | MBTYPE_RESERVE |
+                           MBTYPE_DELETED | MBTYPES_NONIMAP))
+        return 0;
+
+    if (!(cyrus_acl_myrights(imapd_authstate, mbentry->acl) & ACL_READ))
+        return 0;
+
+    strarray_append(mboxes, mbentry->name);
+    return 0;
+}
+
+static void notify_addmbox(const char *intname, strarray_t *mboxes)
+{
+    mbentry_t *mbentry = NULL;
+
+    if (!mboxlist_lookup(intname, &mbentry, NULL))
+        notify_addmbox_cb(mbentry, mboxes);
+    mboxlist_entry_free(&mbentry);
+}
+
+/*
+ * Add the mailboxes selected by the XNOTIFY event group 'group'
+ * to 'mboxes'.
+ */
+static void notify_group_mboxes(const struct notify_group *group,
+                                strarray_t *mboxes)
+{
+    strarray_t *subs;
+    int i;
+
+    if (group->none) return;
+
+    switch (group->filter) {
+    case NOTIFY_SELECTED:
+        /* IDLE already watches the selected mailbox */
+        break;
+
+    case NOTIFY_PERSONAL:
+        mboxlist_usermboxtree(imapd_userid, notify_addmbox_cb, mboxes, 0);
+        break;
+
+    case NOTIFY_SUBSCRIBED:
+        subs = mboxlist_sublist(imapd_userid);
+        for (i = 0; subs && i < subs->count; i++)
+            notify_addmbox(strarray_nth(subs, i), mboxes);
+        strarray_free(subs);
+        break;
+
+    case NOTIFY_SUBTREE:
+    case NOTIFY_MAILBOXES:
+        for (i = 0; i < group->names.count; i++) {
+            char *intname =
+                mboxname_from_external(strarray_nth(&group->names, i),
+                                       &imapd_namespace, imapd_userid);
+            if (group->filter == NOTIFY_SUBTREE)
+                mboxlist_mboxtree(intname, notify_addmbox_cb, mboxes, 0);
+            else
+                notify_addmbox(intname, mboxes);
+            free(intname);
+        }
+        break;
+    }
+}
+
+/*
+ * Send a STATUS response for each of 'mboxnames'
+ */
+static void notify_status(const strarray_t *mboxnames)
+{
+    unsigned statusitems = STATUS_MESSAGES | STATUS_UIDNEXT |
+                           STATUS_UIDVALIDITY | STATUS_UNSEEN;
+    int i;
+
+    if (client_capa & CAPA_CONDSTORE)
+        statusitems |= STATUS_HIGHESTMODSEQ;
+
+    for (i = 0; i < mboxnames->count; i++) {
+        const char *mboxname = strarray_nth(mboxnames, i);
+        struct statusdata sdata = STATUSDATA_INIT;
+        char *extname;
+
+        if (!strcmpsafe(mboxname, index_mboxname(imapd_index)))
+            continue;
+        if (imapd_statusdata(mboxname, statusitems, &sdata))
+            continue;
+
+        extname = mboxname_to_external(mboxname, &imapd_namespace,
+                                       imapd_userid);
+        print_statusline(extname, statusitems, &sdata);
+        free(extname);
+    }
+}
+
+/*
+ * Perform an XNOTIFY command.
+ *
+ * This takes the arguments of NOTIFY (RFC 5465), but only implements a
+ * subset of it, hence the X: changes to the mailboxes selected by the
+ * event groups are reported with STATUS responses while the client is
+ * IDLE, and the event lists themselves are not distinguished.
+ */
+static void cmd_xnotify(char *tag)
+{
+    static struct buf arg;
+    strarray_t mboxes = STRARRAY_INITIALIZER;
+    int status = 0;
+    int c;
+
+    c = getword(imapd_in, &arg);
+
+    if (!strcasecmp(arg.s, "none")) {
+        if (c == '\r') c = prot_getc(imapd_in);
+        if (c != '\n') goto badargs;
+
+        strarray_fini(&notify_mboxes);
+        goto ok;
+    }
+
+    if (strcasecmp(arg.s, "set") || c != ' ') goto badargs;
+
+    c = prot_getc(imapd_in);
+    if (c != '(') {
+        prot_ungetc(c, imapd_in);
+        c = getword(imapd_in, &arg);
+        if (strcasecmp(arg.s, "status") || c != ' ') goto badargs;
+        status = 1;
+        c = prot_getc(imapd_in);
+    }
+
+    for (;;) {
+        struct notify_group group;
+
+        if (c != '(') goto badargs;
+        c = get_notify_group(imapd_in, imapd_out, &group);
+        if (c != EOF) notify_group_mboxes(&group, &mboxes);
+        strarray_fini(&group.names);
+        if (c != ' ') break;
+        c = prot_getc(imapd_in);
+    }
+
+    if (c == '\r') c = prot_getc(imapd_in);
+    if (c != '\n') goto badargs;
+
+    strarray_sort(&mboxes, cmpstringp_raw);
+    strarray_uniq(&mboxes);
+
+    strarray_fini(&notify_mboxes);
+    notify_mboxes = mboxes;
+
+    if (status) notify_status(&notify_mboxes);
+
+ ok:
+    if (global_conversations) {
+        conversations_abort(&global_conversations);
+        global_conversations = NULL;
+    }
+
+    prot_printf(imapd_out, "%s OK %s\r\n", tag,
+                error_message(IMAP_OK_COMPLETED));
+    return;
+
+ badargs:
+    strarray_fini(&mboxes);
+    prot_printf(imapd_out, "%s BAD Invalid arguments to Xnotify\r\n", tag);
+    eatline(imapd_in, (c == EOF ? ' ' : c));
+}
+
 static void cmd_xkillmy(const char *tag, const char *cmdname)
 {
     char *cmd = xstrdup(cmdname);
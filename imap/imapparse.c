@@ -437,6 +437,88 @@ EXPORTED void eatline(struct protstream *pin, int c)
     }
 }
 
+/*
+ * Parse one event group of XNOTIFY SET, after its open parenthesis:
+ *
+ *   filter-mailboxes SP ( "(" event *(SP event) ")" / "NONE" ) ")"
+ *
+ * Mailbox names are returned unconverted in group->names, which the
+ * caller must strarray_fini().  The events are skipped, as every change
+ * is reported alike.  Returns the character after the close parenthesis,
+ * or EOF on a syntax error.
+ */
+EXPORTED int get_notify_group(struct protstream *pin, struct protstream *pout,
+                              struct notify_group *group)
+{
+    static struct buf arg;
+    int c, depth;
+
+    memset(group, 0, sizeof(struct notify_group));
+
+    c = getword(pin, &arg);
+    if (c != ' ') goto bad;
+
+    if (!strcasecmp(arg.s, "selected") ||
+        !strcasecmp(arg.s, "selected-delayed"))
+        group->filter = NOTIFY_SELECTED;
+    else if (!strcasecmp(arg.s, "personal") ||
+             !strcasecmp(arg.s, "inboxes"))
+        group->filter = NOTIFY_PERSONAL;
+    else if (!strcasecmp(arg.s, "subscribed"))
+        group->filter = NOTIFY_SUBSCRIBED;
+    else if (!strcasecmp(arg.s, "subtree"))
+        group->filter = NOTIFY_SUBTREE;
+    else if (!strcasecmp(arg.s, "mailboxes"))
+        group->filter = NOTIFY_MAILBOXES;
+    else goto bad;
+
+    if (group->filter == NOTIFY_SUBTREE || group->filter == NOTIFY_MAILBOXES) {
+        c = prot_getc(pin);
+        if (c == '(') {
+            do {
+                c = getastring(pin, pout, &arg);
+                if (c == EOF) goto bad;
+                strarray_append(&group->names, arg.s);
+            } while (c == ' ');
+            if (c != ')') goto bad;
+            c = prot_getc(pin);
+        }
+        else {
+            prot_ungetc(c, pin);
+            c = getastring(pin, pout, &arg);
+            if (c == EOF) goto bad;
+            strarray_append(&group->names, arg.s);
+        }
+        if (c != ' ') goto bad;
+    }
+
+    c = prot_getc(pin);
+    if (c == '(') {
+        /* skip the events, including any fetch attributes of MessageNew */
+        for (depth = 1; depth; ) {
+            c = prot_getc(pin);
+            if (c == EOF || c == '\r' || c == '\n') goto bad;
+            if (c == '(') depth++;
+            else if (c == ')') depth--;
+        }
+        c = prot_getc(pin);
+    }
+    else {
+        prot_ungetc(c, pin);
+        c = getword(pin, &arg);
+        if (strcasecmp(arg.s, "none")) goto bad;
+        group->none = 1;
+    }
+    if (c != ')') goto bad;
+
+    return prot_getc(pin);
+
+ bad:
+    /* leave the end of the line for the caller to eat */
+    if (c == '\r' || c == '\n') prot_ungetc(c, pin);
+    return EOF;
+}
+
 /*
  * Parse a "date", for SEARCH criteria
  * The time_t's pointed to by 'start' and 'end' are set to the
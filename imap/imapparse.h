@@ -46,6 +46,7 @@
 #include "libconfig.h"
 #include "prot.h"
 #include "index.h"
+#include "strarray.h"
 
 /* imap parsing functions (imapparse.c) */
 int getword(struct protstream *in, struct buf *buf);
@@ -94,4 +95,22 @@ void eatline(struct protstream *pin, int c);
 
 int get_search_program(struct protstream *pin, struct protstream *pout, struct searchargs *searchargs);
 
+/* An event group of XNOTIFY SET (after RFC 5465 NOTIFY) */
+enum notify_filter {
+    NOTIFY_SELECTED,
+    NOTIFY_PERSONAL,
+    NOTIFY_SUBSCRIBED,
+    NOTIFY_SUBTREE,
+    NOTIFY_MAILBOXES
+};
+
+struct notify_group {
+    enum notify_filter filter;
+    strarray_t names;           /* for NOTIFY_SUBTREE and NOTIFY_MAILBOXES */
+    int none;                   /* the event list was NONE */
+};
+
+int get_notify_group(struct protstream *pin, struct protstream *pout,
+                     struct notify_group *group);
+
 #endif /* __CYRUS_IMAP_PARSE_H__ */
@@ -74,6 +74,7 @@
 #include "search_engines.h"
 #include "search_query.h"
 #include "seen.h"
+#include "sortcache.h"
 #include "statuscache.h"
 #include "strhash.h"
 #include "user.h"
@@ -1865,6 +1866,190 @@ out:
     return nmsg;
 }
 
+/*
+ * Sort every message in the mailbox by 'sortcrit' and record the
+ * resulting UID order in the sortcache.
+ */
+static uint32_t *index_sort_rebuild(struct index_state *state,
+                                    const struct sortcrit *sortcrit,
+                                    unsigned *nuidsp)
+{
+    MsgData **msgdata;
+    uint32_t *uids;
+    unsigned i;
+
+    msgdata = index_msgdata_load(state, NULL, state->exists,
+                                 sortcrit, 0, NULL);
+    index_msgdata_sort(msgdata, state->exists, sortcrit);
+
+    uids = xmalloc((state->exists ? state->exists : 1) * sizeof(uint32_t));
+    for (i = 0; i < state->exists; i++)
+        uids[i] = msgdata[i]->uid;
+
+    index_msgdata_free(msgdata, state->exists);
+
+    sortcache_store(index_mboxname(state), sortcrit,
+                    state->mailbox->i.uidvalidity, state->last_uid,
+                    uids, state->exists);
+
+    *nuidsp = state->exists;
+    return uids;
+}
+
+/* rebuild from scratch rather than merge more than 1/Nth new messages */
+#define SORTCACHE_MERGE_RATIO 16
+/* write a merged order back once it has drifted this far from the entry */
+#define SORTCACHE_WRITEBACK 64
+
+/*
+ * Merge the messages appended since 'last_uid' into the cached order
+ * 'uids'.  Only the new messages are loaded and sorted; each is then
+ * placed by a binary search of the cached order, which loads one
+ * cached message per probe.  Expunged messages are dropped as they
+ * can no longer be compared.
+ *
+ * The merged order is only written back once enough has changed, so
+ * that a busy mailbox doesn't rewrite its entry on every SORT.
+ */
+static uint32_t *index_sort_merge(struct index_state *state,
+                                  const struct sortcrit *sortcrit,
+                                  uint32_t *uids, unsigned *nuidsp,
+                                  uint32_t last_uid)
+{
+    unsigned nuids = *nuidsp;
+    unsigned *old = xmalloc((nuids ? nuids : 1) * sizeof(unsigned));
+    unsigned *new = NULL;
+    unsigned nold = 0, nnew = 0, lo, hi, mid, i, j;
+    MsgData **newdata = NULL;
+    uint32_t msgno;
+
+    for (i = 0; i < nuids; i++) {
+        msgno = index_finduid(state, uids[i]);
+        if (msgno && index_getuid(state, msgno) == uids[i])
+            old[nold++] = msgno;
+    }
+
+    for (msgno = state->exists; msgno; msgno--) {
+        if (index_getuid(state, msgno) <= last_uid) break;
+        nnew++;
+    }
+
+    if (nnew > nold / SORTCACHE_MERGE_RATIO) {
+        /* cheaper to sort the lot */
+        free(old);
+        free(uids);
+        return index_sort_rebuild(state, sortcrit, nuidsp);
+    }
+
+    if (nnew) {
+        new = xmalloc(nnew * sizeof(unsigned));
+        for (i = 0; i < nnew; i++)
+            new[i] = state->exists - nnew + 1 + i;
+        newdata = index_msgdata_load(state, new, nnew, sortcrit, 0, NULL);
+        index_msgdata_sort(newdata, nnew, sortcrit);
+    }
+
+    uids = xrealloc(uids, (nold + nnew ? nold + nnew : 1) * sizeof(uint32_t));
+
+    for (i = 0, j = 0, lo = 0; j < nnew; j++) {
+        /* the new messages are in order, so each one goes after the last */
+        hi = nold;
+        while (lo < hi) {
+            MsgData **md;
+            int cmp;
+
+            mid = lo + (hi - lo) / 2;
+            md = index_msgdata_load(state, &old[mid], 1, sortcrit, 0, NULL);
+            cmp = index_sort_compare(newdata[j], md[0], sortcrit);
+            index_msgdata_free(md, 1);
+
+            if (cmp < 0) hi = mid;
+            else lo = mid + 1;
+        }
+
+        for ( ; i < lo; i++)
+            uids[i + j] = index_getuid(state, old[i]);
+        uids[i + j] = newdata[j]->uid;
+    }
+    for ( ; i < nold; i++)
+        uids[i + j] = index_getuid(state, old[i]);
+
+    if (nnew + (nuids - nold) >= SORTCACHE_WRITEBACK) {
+        sortcache_store(index_mboxname(state), sortcrit,
+                        state->mailbox->i.uidvalidity, state->last_uid,
+                        uids, nold + nnew);
+    }
+
+    index_msgdata_free(newdata, nnew);
+    free(new);
+    free(old);
+
+    *nuidsp = nold + nnew;
+    return uids;
+}
+
+/*
+ * Output the messages matched in 'folder' in the order recorded in
+ * the sortcache, merging in new messages if the cached order is
+ * behind, or rebuilding it if it is missing.
+ */
+static void index_sort_cached(struct index_state *state,
+                              search_folder_t *folder,
+                              const struct sortcrit *sortcrit,
+                              unsigned nmsg, int usinguid)
+{
+    uint32_t *uids = NULL;
+    uint32_t *out = xmalloc(nmsg * sizeof(uint32_t));
+    uint32_t last_uid = 0;
+    unsigned nuids = 0, nout, i;
+    int rebuilt = 0;
+
+    if (sortcache_lookup(index_mboxname(state), sortcrit,
+                         state->mailbox->i.uidvalidity,
+                         &last_uid, &uids, &nuids) ||
+        last_uid > state->last_uid) {
+        free(uids);
+        uids = index_sort_rebuild(state, sortcrit, &nuids);
+        rebuilt = 1;
+    }
+    else if (last_uid < state->last_uid) {
+        uids = index_sort_merge(state, sortcrit, uids, &nuids, last_uid);
+    }
+
+again:
+    /* Expunges don't change the relative order of the remaining
+     * messages, so we just skip anything which didn't match */
+    for (i = 0, nout = 0; i < nuids && nout < nmsg; i++) {
+        uint32_t uid = uids[i];
+
+        if (!bv_isset(&folder->uids, uid))
+            continue;
+
+        if (usinguid) {
+            out[nout++] = uid;
+        }
+        else {
+            uint32_t msgno = index_finduid(state, uid);
+            if (msgno && index_getuid(state, msgno) == uid)
+                out[nout++] = msgno;
+        }
+    }
+
+    if (nout < nmsg && !rebuilt) {
+        /* the cache doesn't know about some of these messages */
+        free(uids);
+        uids = index_sort_rebuild(state, sortcrit, &nuids);
+        rebuilt = 1;
+        goto again;
+    }
+
+    for (i = 0; i < nout; i++)
+        prot_printf(state->out, " %u", out[i]);
+
+    free(uids);
+    free(out);
+}
+
 /*
  * Performs a SORT command
  */
@@ -1877,6 +2062,8 @@ EXPORTED int index_sort(struct index_state *state,
     modseq_t highestmodseq = 0;
     search_query_t *query = NULL;
     search_folder_t *folder = NULL;
+    int usecache = config_getswitch(IMAPOPT_SORTCACHE) &&
+                   sortcache_cansort(sortcrit);
     int r;
 
     /* update the index */
@@ -1887,7 +2074,8 @@ EXPORTED int index_sort(struct index_state *state,
 
     /* Search for messages based on the given criteria */
     query = search_query_new(state, searchargs);
-    query->sortcrit = sortcrit;
+    /* with the sortcache we only need the matching UIDs */
+    query->sortcrit = usecache ? NULL : sortcrit;
     r = search_query_run(query);
     if (r) goto out;        /* search failed */
     folder = search_query_find_folder(query, index_mboxname(state));
@@ -1900,7 +2088,10 @@ EXPORTED int index_sort(struct index_state *state,
 
     prot_printf(state->out, "* SORT");
 
-    if (nmsg) {
+    if (nmsg && usecache) {
+        index_sort_cached(state, folder, sortcrit, nmsg, usinguid);
+    }
+    else if (nmsg) {
         /* Output the sorted messages */
         for (i = 0 ; i < query->merged_msgdata.count ; i++) {
             MsgData *md = ptrarray_nth(&query->merged_msgdata, i);
@@ -2718,6 +2909,76 @@ out:
     return r;
 }
 
+/*
+ * Thread the messages in 'msgno_list' using the response recorded in
+ * the sortcache if it was computed by the same search over the same set
+ * of messages, otherwise run the threader and record its response.
+ * Only the latest response for each algorithm is kept, so the cache
+ * doesn't grow with every distinct search a client makes.
+ */
+static void index_thread_cached(struct index_state *state, int algorithm,
+                                struct searchargs *searchargs,
+                                unsigned *msgno_list, int nmsg, int usinguid)
+{
+    struct buf what = BUF_INITIALIZER;
+    struct buf resp = BUF_INITIALIZER;
+    struct buf match = BUF_INITIALIZER;
+    struct message_guid uidset;
+    char *search;
+    const char *p, *q;
+    int i;
+
+    /* the threads only depend on immutable data of the matched messages,
+     * so identify the response by the search and the UIDs it matched */
+    search = search_expr_serialise(searchargs->root);
+    buf_appendcstr(&match, search);
+    buf_putc(&match, '\0');
+    free(search);
+    for (i = 0; i < nmsg; i++) {
+        uint32_t uid = htonl(index_getuid(state, msgno_list[i]));
+        buf_appendmap(&match, (const char *)&uid, sizeof(uid));
+    }
+    message_guid_generate(&uidset, match.s, match.len);
+    buf_free(&match);
+
+    buf_printf(&what, "THREAD=%s", thread_algs[algorithm].alg_name);
+
+    if (sortcache_lookup_text(index_mboxname(state), buf_cstring(&what),
+                              state->mailbox->i.uidvalidity, &uidset, &resp)) {
+        /* always record the response with UIDs */
+        struct protstream *out = state->out;
+
+        state->out = prot_writebuf(&resp);
+        (*thread_algs[algorithm].threader)(state, msgno_list, nmsg, 1);
+        prot_flush(state->out);
+        prot_free(state->out);
+        state->out = out;
+
+        sortcache_store_text(index_mboxname(state), buf_cstring(&what),
+                             state->mailbox->i.uidvalidity, &uidset, &resp);
+    }
+
+    if (usinguid) {
+        prot_putbuf(state->out, &resp);
+    }
+    else {
+        /* every number in the response is a UID */
+        for (p = buf_cstring(&resp); *p; p = q) {
+            if (cyrus_isdigit(*p)) {
+                uint32_t uid = strtoul(p, (char **)&q, 10);
+                prot_printf(state->out, "%u", index_finduid(state, uid));
+            }
+            else {
+                for (q = p; *q && !cyrus_isdigit(*q); q++);
+                prot_write(state->out, p, q - p);
+            }
+        }
+    }
+
+    buf_free(&what);
+    buf_free(&resp);
+}
+
 /*
  * Performs a THREAD command
  */
@@ -2756,7 +3017,12 @@ EXPORTED int index_thread(struct index_state *state, int algorithm,
 
     if (nmsg) {
         /* Thread messages using given algorithm */
-        (*thread_algs[algorithm].threader)(state, msgno_list, nmsg, usinguid);
+        if (config_getswitch(IMAPOPT_SORTCACHE))
+            index_thread_cached(state, algorithm, searchargs,
+                                msgno_list, nmsg, usinguid);
+        else
+            (*thread_algs[algorithm].threader)(state, msgno_list, nmsg,
+                                               usinguid);
 
         free(msgno_list);
 
@@ -853,6 +853,81 @@ static int sieve_find_script(const char *user, const char *domain,
     return 0;
 }
 
+/*
+ * Compiled scripts (and the scripts they include) kept loaded between
+ * deliveries, up to sieve_bytecode_cache of them, so that a busy user's
+ * bytecode isn't opened and mapped again for every message.  An entry is
+ * used only while none of its scripts, including the ones it included,
+ * has changed on disk since it was loaded.
+ */
+struct sieve_cache_entry {
+    char *fname;
+    unsigned long lastuse;
+    sieve_execute_t *exe;
+};
+
+static struct sieve_cache_entry *sieve_cache = NULL;
+static int sieve_cache_size = -1;
+static unsigned long sieve_cache_tick = 0;
+
+static void sieve_cache_free(struct sieve_cache_entry *e)
+{
+    if (e->exe) sieve_script_unload(&e->exe);
+    free(e->fname);
+    memset(e, 0, sizeof(struct sieve_cache_entry));
+}
+
+/* Load the script 'fname', from the cache if we can.  Sets 'cached' if
+ * the script belongs to the cache rather than the caller */
+static int sieve_cache_load(const char *fname, sieve_execute_t **ret,
+                            int *cached)
+{
+    struct sieve_cache_entry *e = NULL;
+    int i, r;
+
+    *cached = 0;
+
+    if (sieve_cache_size < 0) {
+        sieve_cache_size = config_getint(IMAPOPT_SIEVE_BYTECODE_CACHE);
+        if (sieve_cache_size > 0)
+            sieve_cache = xzmalloc(sieve_cache_size *
+                                   sizeof(struct sieve_cache_entry));
+    }
+    if (sieve_cache_size <= 0)
+        return sieve_script_load(fname, ret);
+
+    /* find the script, or the least recently used entry to replace */
+    for (i = 0; i < sieve_cache_size; i++) {
+        struct sieve_cache_entry *this = &sieve_cache[i];
+
+        if (this->fname && !strcmp(this->fname, fname)) {
+            e = this;
+            break;
+        }
+        if (!e || (e->fname && this->lastuse < e->lastuse)) e = this;
+    }
+
+    if (e->fname && !strcmp(e->fname, fname) &&
+        !sieve_script_changed(e->exe)) {
+        e->lastuse = ++sieve_cache_tick;
+        *ret = e->exe;
+        *cached = 1;
+        return SIEVE_OK;
+    }
+
+    sieve_cache_free(e);
+
+    r = sieve_script_load(fname, ret);
+    if (r != SIEVE_OK) return r;
+
+    e->fname = xstrdup(fname);
+    e->lastuse = ++sieve_cache_tick;
+    e->exe = *ret;
+    *cached = 1;
+
+    return SIEVE_OK;
+}
+
 int run_sieve(const mbname_t *mbname, sieve_interp_t *interp, deliver_data_t *msgdata)
 {
     struct buf attrib = BUF_INITIALIZER;
@@ -860,7 +935,7 @@ int run_sieve(const mbname_t *mbname, sieve_interp_t *interp, deliver_data_t *ms
     char fname[MAX_MAILBOX_PATH+1];
     sieve_execute_t *bc = NULL;
     script_data_t sdata;
-    int r = 0;
+    int r = 0, cached = 0;
     duplicate_key_t dkey = DUPLICATE_INITIALIZER;
     struct auth_state *freeauthstate = NULL;
 
@@ -877,7 +952,7 @@ int run_sieve(const mbname_t *mbname, sieve_interp_t *interp, deliver_data_t *ms
 
     if (sieve_find_script(mbname_localpart(mbname), mbname_domain(mbname),
                           script, fname, sizeof(fname)) != 0 ||
-        sieve_script_load(fname, &bc) != SIEVE_OK) {
+        sieve_cache_load(fname, &bc, &cached) != SIEVE_OK) {
         buf_free(&attrib);
         /* no sieve script */
         return 1; /* do normal delivery actions */
@@ -908,7 +983,7 @@ int run_sieve(const mbname_t *mbname, sieve_interp_t *interp, deliver_data_t *ms
 
     /* free everything */
     if (freeauthstate) auth_freestate(freeauthstate);
-    sieve_script_unload(&bc);
+    if (!cached) sieve_script_unload(&bc);
 
     /* if there was an error, r is non-zero and
        we'll do normal delivery */
@@ -42,6 +42,7 @@
 
 #include <config.h>
 
+#include <errno.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -67,6 +68,7 @@
 #include "append.h"
 #include "assert.h"
 #include "auth.h"
+#include "crc32.h"
 #ifdef USE_AUTOCREATE
 #include "autocreate.h"
 #endif
@@ -154,6 +156,7 @@ static struct stagemsg *stage = NULL;
 
 /* per-user/session state */
 static struct protstream *deliver_out, *deliver_in;
+static int deliver_helper = 0;  /* are we a parallel delivery helper? */
 int deliver_logfd = -1; /* used in lmtpengine.c */
 
 /* our cached connections */
@@ -306,6 +309,7 @@ int service_main(int argc, char **argv,
     }
 
     sync_log_init();
+    sync_log_buffer();
 
     deliver_in = prot_new(0, 0);
     deliver_out = prot_new(1, 1);
@@ -814,10 +818,189 @@ EXPORTED int deliver_local(deliver_data_t *mydata, const strarray_t *flags,
     return ret;
 }
 
+/*
+ * Deliver to local recipient 'n', running their sieve script if any,
+ * and return the result for msg_setrcpt_status()
+ */
+static int deliver_one(deliver_data_t *mydata, int n)
+{
+    const mbname_t *mbname = msg_getrcpt(mydata->m, n);
+    int r;
+
+    mydata->cur_rcpt = n;
+#ifdef USE_SIEVE
+    r = run_sieve(mbname, sieve_interp, mydata);
+    /* if there was no sieve script, or an error during execution,
+       r is non-zero and we'll do normal delivery */
+#else
+    r = 1;      /* normal delivery */
+#endif
+
+    if (r) {
+        r = deliver_local(mydata, NULL, mbname);
+    }
+
+    telemetry_rusage(mbname_userid(mbname));
+
+    return r;
+}
+
+/*
+ * Deliver to the local recipients 'local' from up to
+ * lmtp_parallel_deliveries helper processes.  Recipients are spread over
+ * the helpers by user, so all deliveries for one user (and so to one
+ * mailbox and duplicate delivery record) happen in order in a single
+ * helper, and each helper only ever holds one mailbox lock at a time,
+ * just like separate lmtpd processes do.
+ *
+ * Each helper reports "<rcpt> <result>" lines for its recipients, and
+ * "P <path>" for any stage parts it had to create, over a pipe.
+ * Recipients we never hear about (eg a helper crashed) get a temporary
+ * failure.  If we can't start a helper, its recipients are delivered
+ * here instead.
+ */
+static void deliver_parallel(deliver_data_t *mydata, int *local, int nlocal)
+{
+    message_data_t *msgdata = mydata->m;
+    int nprocs = config_getint(IMAPOPT_LMTP_PARALLEL_DELIVERIES);
+    int *result, *helper;
+    pid_t *pids;
+    FILE **pipes;
+    strarray_t extraparts = STRARRAY_INITIALIZER;
+    int i, n, nparts;
+
+    if (nprocs > nlocal) nprocs = nlocal;
+
+    result = xmalloc(sizeof(int) * nlocal);
+    helper = xmalloc(sizeof(int) * nlocal);
+    pids = xzmalloc(sizeof(pid_t) * nprocs);
+    pipes = xzmalloc(sizeof(FILE *) * nprocs);
+
+    for (i = 0; i < nlocal; i++) {
+        const mbname_t *mbname = msg_getrcpt(msgdata, local[i]);
+        const char *owner = mbname_userid(mbname);
+
+        if (!owner) owner = mbname_intname(mbname);
+        helper[i] = crc32_cstring(owner) % nprocs;
+        result[i] = IMAP_IOERROR;
+
+        /* create the stage part for each partition now, rather than
+         * have the helpers race each other to create them */
+        append_preparestage(mydata->stage, mbname_intname(mbname));
+    }
+    for (nparts = 0; append_stagepart(mydata->stage, nparts); nparts++);
+
+    /* parse the message once, rather than once per helper */
+    if (!mydata->content->body) {
+        message_parse_file(msgdata->f, &mydata->content->base,
+                           &mydata->content->len, &mydata->content->body);
+    }
+
+    /* flush anything buffered so the helpers don't write it again */
+    fflush(NULL);
+
+    for (n = 0; n < nprocs; n++) {
+        int fds[2];
+
+        if (pipe(fds) < 0) {
+            syslog(LOG_ERR, "IOERROR: pipe for delivery helper: %m");
+            pids[n] = -1;
+            continue;
+        }
+
+        pids[n] = fork();
+        if (pids[n] < 0) {
+            syslog(LOG_ERR, "IOERROR: fork for delivery helper: %m");
+            close(fds[0]);
+            close(fds[1]);
+            continue;
+        }
+
+        if (pids[n] == 0) {
+            /* helper: deliver to our share and report back */
+            FILE *out = fdopen(fds[1], "w");
+            FILE *f;
+            const char *part;
+
+            close(fds[0]);
+            deliver_helper = 1;
+            deliver_out = NULL;
+            stage = NULL;
+
+            /* don't share a file offset with the parent or other helpers */
+            f = fopen(append_stagefname(mydata->stage), "r");
+            if (f) msgdata->f = f;
+
+            for (i = 0; i < nlocal; i++) {
+                if (helper[i] != n) continue;
+                fprintf(out, "%d %d\n", local[i],
+                        deliver_one(mydata, local[i]));
+            }
+            for (i = nparts; (part = append_stagepart(mydata->stage, i)); i++)
+                fprintf(out, "P %s\n", part);
+
+            fclose(out);
+            sync_log_flush();
+            _exit(0);
+        }
+
+        close(fds[1]);
+        pipes[n] = fdopen(fds[0], "r");
+    }
+
+    /* deliver here for any helpers we couldn't start */
+    for (i = 0; i < nlocal; i++) {
+        if (pids[helper[i]] > 0) continue;
+        result[i] = deliver_one(mydata, local[i]);
+    }
+
+    /* collect the helpers' results */
+    for (n = 0; n < nprocs; n++) {
+        char buf[MAX_MAILBOX_PATH+10];
+
+        if (pids[n] <= 0) continue;
+
+        while (pipes[n] && fgets(buf, sizeof(buf), pipes[n])) {
+            int rcpt, r;
+
+            buf[strcspn(buf, "\n")] = '\0';
+            if (buf[0] == 'P' && buf[1] == ' ') {
+                strarray_append(&extraparts, buf + 2);
+                continue;
+            }
+            if (sscanf(buf, "%d %d", &rcpt, &r) != 2) continue;
+
+            for (i = 0; i < nlocal; i++) {
+                if (local[i] == rcpt && helper[i] == n) {
+                    result[i] = r;
+                    break;
+                }
+            }
+        }
+        if (pipes[n]) fclose(pipes[n]);
+
+        while (waitpid(pids[n], NULL, 0) < 0 && errno == EINTR);
+    }
+
+    for (i = 0; i < nlocal; i++)
+        msg_setrcpt_status(msgdata, local[i], result[i]);
+
+    /* remove the stage parts the helpers created */
+    for (i = 0; i < extraparts.count; i++)
+        unlink(strarray_nth(&extraparts, i));
+
+    strarray_fini(&extraparts);
+    free(pipes);
+    free(pids);
+    free(helper);
+    free(result);
+}
+
 int deliver(message_data_t *msgdata, char *authuser,
             struct auth_state *authstate)
 {
-    int n, nrcpts;
+    int n, nrcpts, nlocal = 0;
+    int *local;
     struct dest *dlist = NULL;
     enum rcpt_status *status;
     struct message_content content = { NULL, 0, NULL };
@@ -842,7 +1025,9 @@ int deliver(message_data_t *msgdata, char *authuser,
     mydata.authuser = authuser;
     mydata.authstate = authstate;
 
-    /* loop through each recipient, attempting delivery for each */
+    /* loop through each recipient, handing remote ones to the proxy and
+     * collecting the local ones */
+    local = xzmalloc(sizeof(int) * nrcpts);
     for (n = 0; n < nrcpts; n++) {
         const mbname_t *mbname = msg_getrcpt(msgdata, n);
 
@@ -857,18 +1042,9 @@ int deliver(message_data_t *msgdata, char *authuser,
         }
         else if (!r) {
             /* local mailbox */
-            mydata.cur_rcpt = n;
-#ifdef USE_SIEVE
-            r = run_sieve(mbname, sieve_interp, &mydata);
-            /* if there was no sieve script, or an error during execution,
-               r is non-zero and we'll do normal delivery */
-#else
-            r = 1;      /* normal delivery */
-#endif
-
-            if (r) {
-                r = deliver_local(&mydata, NULL, mbname);
-            }
+            local[nlocal++] = n;
+            mboxlist_entry_free(&mbentry);
+            continue;
         }
 
         telemetry_rusage(mbname_userid(mbname));
@@ -878,6 +1054,18 @@ int deliver(message_data_t *msgdata, char *authuser,
         mboxlist_entry_free(&mbentry);
     }
 
+    if (nlocal > 1 && stage &&
+        config_getint(IMAPOPT_LMTP_PARALLEL_DELIVERIES) > 1) {
+        deliver_parallel(&mydata, local, nlocal);
+    }
+    else {
+        for (n = 0; n < nlocal; n++) {
+            int r = deliver_one(&mydata, local[n]);
+            msg_setrcpt_status(msgdata, local[n], r);
+        }
+    }
+    free(local);
+
     if (dlist) {
         struct dest *d;
 
@@ -943,6 +1131,8 @@ int deliver(message_data_t *msgdata, char *authuser,
     stage = NULL;
     if (notifyheader) free(notifyheader);
 
+    sync_log_flush();
+
     return 0;
 }
 
@@ -956,6 +1146,13 @@ EXPORTED void fatal(const char* s, int code)
         exit(recurse_code);
     }
     recurse_code = code;
+    if (deliver_helper) {
+        /* the parent reports our recipients as failed, but anything
+         * already delivered still needs replicating */
+        sync_log_flush();
+        syslog(LOG_ERR, "FATAL: delivery helper: %s", s);
+        _exit(code);
+    }
     if(deliver_out) {
         prot_printf(deliver_out,"421 4.3.0 lmtpd: %s\r\n", s);
         prot_flush(deliver_out);
@@ -84,6 +84,7 @@
 #include "lmtpengine.h"
 #include "tls.h"
 #include "telemetry.h"
+#include "xstats.h"
 
 #define RCPT_GROW 30
 
@@ -944,6 +945,25 @@ static int reset_saslconn(sasl_conn_t **conn)
     return SASL_OK;
 }
 
+/* Map a command line onto a fixed timer name, so that arbitrary client
+ * input can't create new timers */
+static const char *lmtp_cmdname(const char *buf)
+{
+    static const char * const verbs[] = {
+        "lhlo", "mail", "rcpt", "data", "rset", "noop", "quit", "vrfy",
+        "auth", "starttls", NULL
+    };
+    size_t len = strcspn(buf, " ");
+    int i;
+
+    for (i = 0; verbs[i]; i++) {
+        if (len == strlen(verbs[i]) && !strncasecmp(buf, verbs[i], len))
+            return verbs[i];
+    }
+
+    return "unknown";
+}
+
 void lmtpmode(struct lmtp_func *func,
               struct protstream *pin,
               struct protstream *pout,
@@ -963,6 +983,9 @@ void lmtpmode(struct lmtp_func *func,
 
     sasl_security_properties_t *secprops = NULL;
 
+    struct timeval cmdstart;
+    const char *cmdname = NULL;
+
     /* setup the clientdata structure */
     cd.pin = pin;
     cd.pout = pout;
@@ -1041,6 +1064,11 @@ void lmtpmode(struct lmtp_func *func,
 
     for (;;) {
     nextcmd:
+      if (cmdname) {
+          xstats_namedtimer_stop("lmtp", cmdname, &cmdstart);
+          cmdname = NULL;
+      }
+
       signals_poll();
 
       if (!prot_fgets(buf, sizeof(buf), pin)) {
@@ -1056,6 +1084,9 @@ void lmtpmode(struct lmtp_func *func,
       if (p >= buf && *p == '\n') *p-- = '\0';
       if (p >= buf && *p == '\r') *p-- = '\0';
 
+      gettimeofday(&cmdstart, NULL);
+      cmdname = lmtp_cmdname(buf);
+
       /* Only allow LHLO/NOOP/QUIT when there is a shutdown file */
       if (!strchr("LlNnQq", buf[0]) &&
           shutdown_file(buf, sizeof(buf))) {
@@ -1563,6 +1594,7 @@ void lmtpmode(struct lmtp_func *func,
 
  cleanup:
     /* free resources and return; this connection has been closed */
+    if (cmdname) xstats_namedtimer_stop("lmtp", cmdname, &cmdstart);
 
     if (msg) msg_free(msg);
 
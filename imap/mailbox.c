@@ -124,6 +124,10 @@ struct mailboxlist {
 
 static struct mailboxlist *open_mailboxes = NULL;
 
+/* recently closed mailboxes with their files still open, most recent first */
+static struct mailboxlist *closed_mailboxes = NULL;
+static int num_closed_mailboxes = 0;
+
 #define zeromailbox(m) { memset(&m, 0, sizeof(struct mailbox)); \
                          (m).index_fd = -1; \
                          (m).header_fd = -1; }
@@ -185,6 +189,38 @@ static struct mailboxlist *find_listitem(const char *name)
     return NULL;
 }
 
+/* take a recently closed mailbox back off the closed list, if we have it */
+static struct mailboxlist *reopen_listitem(const char *name)
+{
+    struct mailboxlist *item;
+    struct mailboxlist *previtem = NULL;
+
+    for (item = closed_mailboxes; item; item = item->next) {
+        if (!strcmp(name, item->m.name)) break;
+        previtem = item;
+    }
+
+    if (!item) return NULL;
+
+    if (previtem)
+        previtem->next = item->next;
+    else
+        closed_mailboxes = item->next;
+    num_closed_mailboxes--;
+
+    item->next = open_mailboxes;
+    open_mailboxes = item;
+
+    item->nopen = 1;
+    item->l = NULL;
+    gettimeofday(&item->m.starttime, 0);
+
+    if (config_getswitch(IMAPOPT_OBJECT_STORAGE_ENABLED))
+        keep_user_message_db_open (1);
+
+    return item;
+}
+
 static void remove_listitem(struct mailboxlist *remitem)
 {
     struct mailboxlist *item;
@@ -910,6 +946,79 @@ static int mailbox_mboxlock_reopen(struct mailboxlist *listitem, int locktype)
     return r;
 }
 
+static void mailbox_free_fields(struct mailbox *mailbox)
+{
+    int flag;
+
+    free(mailbox->name);
+    free(mailbox->part);
+    free(mailbox->acl);
+    free(mailbox->uniqueid);
+    free(mailbox->quotaroot);
+
+    for (flag = 0; flag < MAX_USER_FLAGS; flag++) {
+        free(mailbox->flagname[flag]);
+    }
+}
+
+/*
+ * Move an unlocked mailbox from the open list to the head of the
+ * closed list, evicting the least recently closed one if it is full.
+ */
+static void retain_listitem(struct mailboxlist *listitem)
+{
+    struct mailboxlist *item, *previtem = NULL;
+    int max = config_getint(IMAPOPT_MAILBOX_OPEN_CACHE);
+
+    for (item = open_mailboxes; item != listitem; item = item->next)
+        previtem = item;
+
+    if (previtem)
+        previtem->next = listitem->next;
+    else
+        open_mailboxes = listitem->next;
+
+    if (!open_mailboxes && config_getswitch(IMAPOPT_OBJECT_STORAGE_ENABLED))
+        keep_user_message_db_open (0);
+
+    listitem->nopen = 0;
+    listitem->next = closed_mailboxes;
+    closed_mailboxes = listitem;
+    num_closed_mailboxes++;
+
+    if (num_closed_mailboxes <= max) return;
+
+    /* evict from the tail */
+    previtem = NULL;
+    for (item = closed_mailboxes; item->next; item = item->next)
+        previtem = item;
+
+    previtem->next = NULL;
+    num_closed_mailboxes--;
+
+    mailbox_release_resources(&item->m);
+    mailbox_free_fields(&item->m);
+    free(item);
+}
+
+/*
+ * Are the files we kept open for a cached mailbox still the ones on
+ * disk?  The index is only ever replaced (by repack, reconstruct or
+ * delete and re-create) with the cache files alongside it, and an inode
+ * can't be reused while we hold it open, so comparing the inodes is
+ * enough.  Header changes are picked up when the index is locked.
+ */
+static int mailbox_files_changed(struct mailbox *mailbox)
+{
+    struct stat sbuf, fdbuf;
+    const char *fname = mailbox_meta_fname(mailbox, META_INDEX);
+
+    if (!fname || stat(fname, &sbuf) == -1) return 1;
+    if (fstat(mailbox->index_fd, &fdbuf) == -1) return 1;
+
+    return (sbuf.st_ino != fdbuf.st_ino || sbuf.st_dev != fdbuf.st_dev);
+}
+
 /*
  * Open and read the header of the mailbox with name 'name'
  * The structure pointed to by 'mailbox' is initialized.
@@ -922,10 +1031,13 @@ static int mailbox_open_advanced(const char *name,
     mbentry_t *mbentry = NULL;
     struct mailboxlist *listitem;
     struct mailbox *mailbox = NULL;
+    struct timeval start;
     int r = 0;
 
     assert(*mailboxptr == NULL);
 
+    xstats_timer_start(&start);
+
     listitem = find_listitem(name);
 
     /* already open?  just use this one */
@@ -945,7 +1057,8 @@ static int mailbox_open_advanced(const char *name,
         goto lockindex;
     }
 
-    listitem = create_listitem(name);
+    listitem = reopen_listitem(name);
+    if (!listitem) listitem = create_listitem(name);
     mailbox = &listitem->m;
 
     r = mboxname_lock(name, &listitem->l, locktype);
@@ -953,42 +1066,53 @@ static int mailbox_open_advanced(const char *name,
         /* locked is not an error - just means we asked for NONBLOCKING */
         if (r != IMAP_MAILBOX_LOCKED)
             syslog(LOG_ERR, "IOERROR: locking %s: %m", mailbox->name);
-        goto done;
+        goto unopened;
     }
 
     r = mboxlist_lookup_allow_all(name, &mbentry, NULL);
-    if (r) goto done;
+    if (r) goto unopened;
 
     if (mbentry->mbtype & MBTYPE_MOVING) {
         mboxlist_entry_free(&mbentry);
         r = IMAP_MAILBOX_MOVED;
-        goto done;
+        goto unopened;
     }
 
     if (!mbentry->partition) {
         mboxlist_entry_free(&mbentry);
         r = IMAP_MAILBOX_NONEXISTENT;
-        goto done;
+        goto unopened;
     }
 
+    /* files kept open from an earlier close must still be current */
+    if (mailbox->index_fd != -1 &&
+        (strcmpsafe(mailbox->part, mbentry->partition) ||
+         mailbox_files_changed(mailbox))) {
+        mailbox_release_resources(mailbox);
+        mailbox->header_file_ino = 0;
+    }
+
+    free(mailbox->part);
     mailbox->part = xstrdup(mbentry->partition);
 
     /* Note that the header does have the ACL information, but it is only
      * a backup, and the mboxlist data is considered authoritative, so
      * we will just use what we were passed */
+    free(mailbox->acl);
     mailbox->acl = xstrdup(mbentry->acl);
     mailbox->mbtype = mbentry->mbtype;
 
     mboxlist_entry_free(&mbentry);
 
-    if (index_locktype == LOCK_SHARED)
-        mailbox->is_readonly = 1;
+    if (mailbox->index_fd == -1) {
+        mailbox->is_readonly = (index_locktype == LOCK_SHARED);
 
-    r = mailbox_open_index(mailbox);
-    if (r) {
-        syslog(LOG_ERR, "IOERROR: opening index %s: %s",
-               mailbox->name, error_message(r));
-        goto done;
+        r = mailbox_open_index(mailbox);
+        if (r) {
+            syslog(LOG_ERR, "IOERROR: opening index %s: %s",
+                   mailbox->name, error_message(r));
+            goto done;
+        }
     }
 
 lockindex:
@@ -997,11 +1121,18 @@ lockindex:
     /* we always nuke expunged if the version is less than 12 */
     if (mailbox->i.minor_version < 12)
         cleanup_stale_expunged(mailbox);
+    goto done;
+
+unopened:
+    /* don't hold on to files kept open from an earlier close */
+    mailbox_release_resources(mailbox);
 
 done:
     if (r) mailbox_close(&mailbox);
     else *mailboxptr = mailbox;
 
+    xstats_timer_stop(MAILBOX_OPEN, &start);
+
     return r;
 }
 
@@ -1091,7 +1222,6 @@ EXPORTED int mailbox_setversion(struct mailbox *mailbox, int version)
  */
 EXPORTED void mailbox_close(struct mailbox **mailboxptr)
 {
-    int flag;
     struct mailbox *mailbox = *mailboxptr;
     struct mailboxlist *listitem;
 
@@ -1147,19 +1277,18 @@ EXPORTED void mailbox_close(struct mailbox **mailboxptr)
          * THEIR mailbox_close call */
     }
 
-    mailbox_release_resources(mailbox);
-
-    free(mailbox->name);
-    free(mailbox->part);
-    free(mailbox->acl);
-    free(mailbox->uniqueid);
-    free(mailbox->quotaroot);
+    if (listitem->l) mboxname_release(&listitem->l);
 
-    for (flag = 0; flag < MAX_USER_FLAGS; flag++) {
-        free(mailbox->flagname[flag]);
+    /* keep the files open and mapped in case we're back soon */
+    if (!in_shutdown && mailbox->index_fd != -1 &&
+        !(mailbox->i.options & MAILBOX_CLEANUP_MASK) &&
+        config_getint(IMAPOPT_MAILBOX_OPEN_CACHE) > 0) {
+        retain_listitem(listitem);
+        return;
     }
 
-    if (listitem->l) mboxname_release(&listitem->l);
+    mailbox_release_resources(mailbox);
+    mailbox_free_fields(mailbox);
 
     remove_listitem(listitem);
 }
@@ -2034,6 +2163,7 @@ EXPORTED int mailbox_find_index_record(struct mailbox *mailbox, uint32_t uid,
 static int mailbox_lock_index_internal(struct mailbox *mailbox, int locktype)
 {
     struct stat sbuf;
+    struct timeval start;
     int r = 0;
     const char *header_fname = mailbox_meta_fname(mailbox, META_HEADER);
     const char *index_fname = mailbox_meta_fname(mailbox, META_INDEX);
@@ -2043,6 +2173,8 @@ static int mailbox_lock_index_internal(struct mailbox *mailbox, int locktype)
 
     r = 0;
 
+    xstats_timer_start(&start);
+
     if (locktype == LOCK_EXCLUSIVE) {
         /* handle read-only case cleanly - we need to re-open read-write first! */
         if (mailbox->is_readonly) {
@@ -2059,6 +2191,8 @@ static int mailbox_lock_index_internal(struct mailbox *mailbox, int locktype)
         fatal("invalid locktype for index", EC_SOFTWARE);
     }
 
+    xstats_timer_stop(MAILBOX_LOCK, &start);
+
     /* double check that the index exists and has at least enough
      * data to check the version number */
     if (!r) {
@@ -2459,6 +2593,7 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
 {
     /* XXX - ibuf for alignment? */
     static unsigned char buf[INDEX_HEADER_SIZE];
+    struct timeval start;
     int n, r;
 
     /* try to commit sub parts first */
@@ -2484,6 +2619,8 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
 
     assert(mailbox_index_islocked(mailbox, 1));
 
+    xstats_timer_start(&start);
+
     r = _commit_changes(mailbox);
     if (r) return r;
 
@@ -2497,6 +2634,8 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
         return IMAP_IOERROR;
     }
 
+    xstats_timer_stop(MAILBOX_COMMIT, &start);
+
     if (config_auditlog && mailbox->modseq_dirty)
         syslog(LOG_NOTICE, "auditlog: modseq sessionid=<%s> "
                "mailbox=<%s> uniqueid=<%s> highestmodseq=<" MODSEQ_FMT ">",
@@ -2789,6 +2928,22 @@ static void mailbox_annot_update_counts(struct mailbox *mailbox,
     }
 }
 
+/* XOR the sync CRCs of a single non-expunged @record into @crcs */
+static void record_synccrcs(struct mailbox *mailbox,
+                            const struct index_record *record,
+                            struct synccrcs *crcs)
+{
+    struct annot_calc_rock cr = { 0, 0 };
+
+    crcs->basic ^= crc_basic(mailbox, record);
+    crcs->annot ^= crc_virtannot(mailbox, record);
+
+    annotatemore_findall(mailbox->name, record->uid, /* all entries*/"*",
+                         calc_one_annot, &cr);
+
+    crcs->annot ^= cr.annot;
+}
+
 /*
  * Calculate a sync CRC for the entire @mailbox using CRC algorithm
  * version @vers, optionally forcing recalculation
@@ -2810,16 +2965,8 @@ EXPORTED struct synccrcs mailbox_synccrcs(struct mailbox *mailbox, int force)
     annotate_state_begin(astate);
 
     struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, ITER_SKIP_EXPUNGED);
-    while ((record = mailbox_iter_step(iter))) {
-        crcs.basic ^= crc_basic(mailbox, record);
-        crcs.annot ^= crc_virtannot(mailbox, record);
-
-        struct annot_calc_rock cr = { 0, 0 };
-        annotatemore_findall(mailbox->name, record->uid, /* all entries*/"*",
-                             calc_one_annot, &cr);
-
-        crcs.annot ^= cr.annot;
-    }
+    while ((record = mailbox_iter_step(iter)))
+        record_synccrcs(mailbox, record, &crcs);
     mailbox_iter_done(&iter);
 
     /* possibly upgrade the stored value */
@@ -2832,6 +2979,41 @@ EXPORTED struct synccrcs mailbox_synccrcs(struct mailbox *mailbox, int force)
     return crcs;
 }
 
+/*
+ * Calculate the sync CRCs of the records in each of the @nranges UID
+ * ranges @first[i]..@last[i] of @mailbox into @crcs[i].  The XOR of
+ * all the ranges covering a mailbox equals mailbox_synccrcs(), so
+ * replication can compare parts of a mailbox to find where two copies
+ * differ without transferring every record.
+ */
+EXPORTED int mailbox_synccrcs_ranges(struct mailbox *mailbox, int nranges,
+                                     const uint32_t *first,
+                                     const uint32_t *last,
+                                     struct synccrcs *crcs)
+{
+    annotate_state_t *astate = NULL;
+    const struct index_record *record;
+    int i, r;
+
+    r = mailbox_get_annotate_state(mailbox, ANNOTATE_ANY_UID, &astate);
+    if (r) return r;
+
+    annotate_state_begin(astate);
+
+    struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, ITER_SKIP_EXPUNGED);
+    for (i = 0; i < nranges; i++) {
+        crcs[i].basic = crcs[i].annot = 0;
+        mailbox_iter_startuid(iter, first[i]);
+        while ((record = mailbox_iter_step(iter))) {
+            if (record->uid > last[i]) break;
+            record_synccrcs(mailbox, record, &crcs[i]);
+        }
+    }
+    mailbox_iter_done(&iter);
+
+    return 0;
+}
+
 static void mailbox_index_update_counts(struct mailbox *mailbox,
                                         const struct index_record *record,
                                         int is_add)
@@ -5361,6 +5543,135 @@ EXPORTED int mailbox_copyfile(const char *from, const char *to, int nolink)
     return 0;
 }
 
+/*
+ * Share the message file for 'record' through the GUID store on its
+ * partition: if the store already has the message, replace our file
+ * with a link to it, otherwise add our file to the store.  The store
+ * entry's link count is the reference count.  Failures only cost the
+ * disk space, so they are logged and otherwise ignored.
+ */
+EXPORTED void mailbox_guidstore_link(struct mailbox *mailbox,
+                                     const struct index_record *record)
+{
+    char fname[MAX_MAILBOX_PATH];
+    char storename[MAX_MAILBOX_PATH];
+    char tmpname[MAX_MAILBOX_PATH];
+    const char *root = NULL;
+    const char *hex;
+    struct stat fsb, ssb;
+
+    if (!config_getswitch(IMAPOPT_SINGLEINSTANCESTORE_GUID) ||
+        !config_getswitch(IMAPOPT_SINGLEINSTANCESTORE))
+        return;
+
+    if (message_guid_isnull(&record->guid))
+        return;
+
+    /* the store lives on whichever partition the file is on */
+    if (!config_getswitch(IMAPOPT_OBJECT_STORAGE_ENABLED) &&
+        (record->system_flags & FLAG_ARCHIVED))
+        root = config_archivepartitiondir(mailbox->part);
+    if (!root)
+        root = config_partitiondir(mailbox->part);
+    if (!root)
+        return;
+
+    hex = message_guid_encode(&record->guid);
+    if ((size_t) snprintf(storename, sizeof(storename), "%s%s/%c%c/%s",
+                          root, FNAME_GUIDSTORE, hex[0], hex[1], hex)
+        >= sizeof(storename))
+        return;
+    if (strlcpy(fname, mailbox_record_fname(mailbox, record), sizeof(fname))
+        >= sizeof(fname))
+        return;
+
+    if (stat(fname, &fsb) == -1)
+        return;
+
+    if (!stat(storename, &ssb)) {
+        /* already shared */
+        if (ssb.st_ino == fsb.st_ino && ssb.st_dev == fsb.st_dev)
+            return;
+
+        /* not the same file system, or not the same message after all */
+        if (ssb.st_dev != fsb.st_dev || ssb.st_size != fsb.st_size)
+            return;
+
+        /* too long to link beside it: just keep our own copy */
+        if ((size_t) snprintf(tmpname, sizeof(tmpname), "%s.guidstore", fname)
+            >= sizeof(tmpname))
+            return;
+        if (link(storename, tmpname) == -1) {
+            /* EMLINK: too popular, just keep our own copy */
+            if (errno != EMLINK)
+                syslog(LOG_ERR, "IOERROR: linking %s to %s: %m",
+                       storename, tmpname);
+            return;
+        }
+        if (rename(tmpname, fname) == -1) {
+            syslog(LOG_ERR, "IOERROR: renaming %s to %s: %m",
+                   tmpname, fname);
+            unlink(tmpname);
+        }
+        return;
+    }
+
+    if (errno != ENOENT) {
+        syslog(LOG_ERR, "IOERROR: stating %s: %m", storename);
+        return;
+    }
+
+    /* first copy on this partition */
+    if (link(fname, storename) == -1 && errno == ENOENT &&
+        !cyrus_mkdir(storename, 0755)) {
+        link(fname, storename);
+    }
+}
+
+/*
+ * Remove files from the GUID store under 'partdir' which are no
+ * longer linked from any mailbox.
+ */
+EXPORTED int mailbox_guidstore_purge(const char *partdir, unsigned *nremoved)
+{
+    char path[MAX_MAILBOX_PATH];
+    DIR *topdir, *subdir;
+    struct dirent *topent, *subent;
+    struct stat sbuf;
+    size_t len;
+
+    len = snprintf(path, sizeof(path), "%s%s", partdir, FNAME_GUIDSTORE);
+    if (len >= sizeof(path)) return IMAP_IOERROR;
+
+    topdir = opendir(path);
+    if (!topdir) return errno == ENOENT ? 0 : IMAP_IOERROR;
+
+    while ((topent = readdir(topdir))) {
+        if (topent->d_name[0] == '.') continue;
+
+        snprintf(path + len, sizeof(path) - len, "/%s", topent->d_name);
+        subdir = opendir(path);
+        if (!subdir) continue;
+
+        while ((subent = readdir(subdir))) {
+            char *fname;
+
+            if (subent->d_name[0] == '.') continue;
+
+            fname = strconcat(path, "/", subent->d_name, (char *)NULL);
+            /* only the store's own link left? */
+            if (!lstat(fname, &sbuf) && S_ISREG(sbuf.st_mode) &&
+                sbuf.st_nlink == 1 && !unlink(fname))
+                (*nremoved)++;
+            free(fname);
+        }
+        closedir(subdir);
+    }
+    closedir(topdir);
+
+    return 0;
+}
+
 /* ---------------------------------------------------------------------- */
 /*                      RECONSTRUCT SUPPORT                               */
 /* ---------------------------------------------------------------------- */
@@ -6488,9 +6799,59 @@ EXPORTED void mailbox_iter_startuid(struct mailbox_iter *iter, uint32_t uid)
     iter->recno = uid ? mailbox_finduid(mailbox, uid-1) : 0;
 }
 
+/*
+ * Check the uid, system_flags and modseq of the iterator's current
+ * record straight from the mapped index, without decoding and CRC
+ * checking the whole record.  Flag-only and CHANGEDSINCE scans over
+ * large mailboxes skip most records, so this avoids touching the rest
+ * of each record entirely.
+ *
+ * Returns 1 if the record would be skipped anyway, 0 if it needs a
+ * full read.
+ */
+static int mailbox_iter_skiprecord(struct mailbox_iter *iter)
+{
+    struct mailbox *mailbox = iter->mailbox;
+    const char *buf;
+    size_t offset;
+    modseq_t modseq = 0;
+
+    /* uncommitted changes live in the change map, not the index file */
+    if (mailbox->index_change_count && _find_change(mailbox, iter->recno))
+        return 0;
+
+    offset = mailbox->i.start_offset + (iter->recno-1) * mailbox->i.record_size;
+
+    /* let mailbox_read_index_record() complain */
+    if (offset + mailbox->i.record_size > mailbox->index_size)
+        return 0;
+
+    buf = mailbox->index_base + offset;
+
+    if (!ntohl(*((bit32 *)(buf+OFFSET_UID))))
+        return 1; /* can happen on damaged mailboxes */
+
+    if (ntohl(*((bit32 *)(buf+OFFSET_SYSTEM_FLAGS))) & iter->skipflags)
+        return 1;
+
+    if (!iter->changedsince)
+        return 0;
+
+    /* same version logic as mailbox_buf_to_index_record() */
+    if (mailbox->i.minor_version >= 10)
+        modseq = ntohll(*((bit64 *)(buf+OFFSET_MODSEQ)));
+    else if (mailbox->i.minor_version >= 8)
+        modseq = ntohll(*((bit64 *)(buf+72)));
+
+    return (modseq <= iter->changedsince);
+}
+
 EXPORTED const struct index_record *mailbox_iter_step(struct mailbox_iter *iter)
 {
+    int canskip = (iter->skipflags || iter->changedsince);
+
     for (iter->recno++; iter->recno <= iter->num_records; iter->recno++) {
+        if (canskip && mailbox_iter_skiprecord(iter)) continue;
         int r = mailbox_read_index_record(iter->mailbox, iter->recno, &iter->record);
         if (r) continue;
         if (!iter->record.uid) continue; /* can happen on damaged mailboxes */
@@ -86,6 +86,7 @@
 #define FNAME_DAV "/cyrus.dav"
 #endif
 #define FNAME_ANNOTATIONS "/cyrus.annotations"
+#define FNAME_GUIDSTORE "/cyrus.guidstore"
 
 enum meta_filename {
   META_HEADER = 1,
@@ -590,6 +591,9 @@ extern int mailbox_rename_cleanup(struct mailbox **mailboxptr, int isinbox);
 
 
 extern int mailbox_copyfile(const char *from, const char *to, int nolink);
+extern void mailbox_guidstore_link(struct mailbox *mailbox,
+                                   const struct index_record *record);
+extern int mailbox_guidstore_purge(const char *partdir, unsigned *nremoved);
 
 extern int mailbox_reconstruct(const char *name, int flags);
 extern void mailbox_make_uniqueid(struct mailbox *mailbox);
@@ -621,6 +625,10 @@ extern const struct index_record *mailbox_iter_step(struct mailbox_iter *iter);
 extern void mailbox_iter_done(struct mailbox_iter **iterp);
 
 struct synccrcs mailbox_synccrcs(struct mailbox *mailbox, int recalc);
+extern int mailbox_synccrcs_ranges(struct mailbox *mailbox, int nranges,
+                                   const uint32_t *first,
+                                   const uint32_t *last,
+                                   struct synccrcs *crcs);
 
 extern int mailbox_add_dav(struct mailbox *mailbox);
 
@@ -81,6 +81,7 @@
 
 #include "mboxlist.h"
 #include "quota.h"
+#include "sortcache.h"
 #include "sync_log.h"
 #include "objectstore_db.h"
 
@@ -1356,6 +1357,8 @@ EXPORTED int mboxlist_deletemailbox(const char *name, int isadmin,
         /* abort event notification */
         if (r && mboxevent)
             mboxevent_free(&mboxevent);
+
+        sortcache_delete(name);
     }
 
  done:
@@ -1623,6 +1626,10 @@ EXPORTED int mboxlist_renamemailbox(const char *oldname, const char *newname,
 
             mailbox_rename_cleanup(&oldmailbox, isusermbox);
 
+            /* neither name's cached orders describe the mailbox now */
+            sortcache_delete(oldname);
+            sortcache_delete(newname);
+
 #ifdef WITH_DAV
             mailbox_add_dav(newmailbox);
 #endif
@@ -176,8 +176,10 @@ static char *message_ucase(char *s)
  * imapd.conf before calling.
  */
 EXPORTED int message_copy_strict(struct protstream *from, FILE *to,
-                                 unsigned size, int allow_null)
+                                 unsigned size, int allow_null,
+                                 struct message_guid *guid)
 {
+    struct message_guid_ctx guidctx;
     char buf[4096+1];
     unsigned char *p, *endp;
     int r = 0;
@@ -187,6 +189,10 @@ EXPORTED int message_copy_strict(struct protstream *from, FILE *to,
     int munge8bit = config_getswitch(IMAPOPT_MUNGE8BIT);
     int inheader = 1, blankline = 1;
 
+    /* hash the message while it's passing through, rather than
+     * reading it all back in again later */
+    if (guid) message_guid_init(&guidctx);
+
     while (size) {
         n = prot_read(from, buf, size > 4096 ? 4096 : size);
         if (!n) {
@@ -238,10 +244,12 @@ EXPORTED int message_copy_strict(struct protstream *from, FILE *to,
             }
         }
 
+        if (guid) message_guid_update(&guidctx, buf, n);
         fwrite(buf, 1, n, to);
     }
 
     if (r) return r;
+    if (guid) message_guid_final(&guidctx, guid);
     fflush(to);
     if (ferror(to) || fsync(fileno(to))) {
         syslog(LOG_ERR, "IOERROR: writing message: %m");
@@ -278,6 +286,16 @@ EXPORTED int message_copy_strict(struct protstream *from, FILE *to,
 }
 
 EXPORTED int message_parse(const char *fname, struct index_record *record)
+{
+    return message_parse_guid(fname, record, NULL);
+}
+
+/*
+ * As message_parse(), but if 'guid' is non-NULL it is the already
+ * known GUID of the file's contents and they aren't hashed.
+ */
+EXPORTED int message_parse_guid(const char *fname, struct index_record *record,
+                                const struct message_guid *guid)
 {
     struct body *body = NULL;
     FILE *f;
@@ -286,7 +304,7 @@ EXPORTED int message_parse(const char *fname, struct index_record *record)
     f = fopen(fname, "r");
     if (!f) return IMAP_IOERROR;
 
-    r = message_parse_file(f, NULL, NULL, &body);
+    r = message_parse_file_guid(f, NULL, NULL, &body, guid);
     if (!r) r = message_create_record(record, body);
 
     fclose(f);
@@ -310,6 +328,23 @@ EXPORTED int message_parse(const char *fname, struct index_record *record)
 EXPORTED int message_parse_file(FILE *infile,
                        const char **msg_base, size_t *msg_len,
                        struct body **body)
+{
+    return message_parse_file_guid(infile, msg_base, msg_len, body, NULL);
+}
+
+static int message_parse_mapped_guid(const char *msg_base,
+                                     unsigned long msg_len,
+                                     struct body *body,
+                                     const struct message_guid *guid);
+
+/*
+ * As message_parse_file(), but if 'guid' is non-NULL it is the
+ * already known GUID of the file's contents and they aren't hashed.
+ */
+EXPORTED int message_parse_file_guid(FILE *infile,
+                       const char **msg_base, size_t *msg_len,
+                       struct body **body,
+                       const struct message_guid *guid)
 {
     int fd = fileno(infile);
     struct stat sbuf;
@@ -336,7 +371,7 @@ EXPORTED int message_parse_file(FILE *infile,
         return IMAP_IOERROR; /* zero length file? */
 
     if (!*body) *body = (struct body *) xzmalloc(sizeof(struct body));
-    r = message_parse_mapped(*msg_base, *msg_len, *body);
+    r = message_parse_mapped_guid(*msg_base, *msg_len, *body, guid);
 
     if (unmap) map_free(msg_base, msg_len);
 
@@ -404,6 +439,14 @@ EXPORTED int message_parse_binary_file(FILE *infile, struct body **body)
  */
 EXPORTED int message_parse_mapped(const char *msg_base, unsigned long msg_len,
                          struct body *body)
+{
+    return message_parse_mapped_guid(msg_base, msg_len, body, NULL);
+}
+
+static int message_parse_mapped_guid(const char *msg_base,
+                                     unsigned long msg_len,
+                                     struct body *body,
+                                     const struct message_guid *guid)
 {
     struct msg msg;
 
@@ -415,7 +458,10 @@ EXPORTED int message_parse_mapped(const char *msg_base, unsigned long msg_len,
     message_parse_body(&msg, body,
                        DEFAULT_CONTENT_TYPE, (strarray_t *)0);
 
-    message_guid_generate(&body->guid, msg_base, msg_len);
+    if (guid && !message_guid_isnull(guid))
+        message_guid_copy(&body->guid, guid);
+    else
+        message_guid_generate(&body->guid, msg_base, msg_len);
 
     return 0;
 }
@@ -129,9 +129,12 @@ struct param {
     char *value;
 };
 extern int message_copy_strict P((struct protstream *from, FILE *to,
-                                  unsigned size, int allow_null));
+                                  unsigned size, int allow_null,
+                                  struct message_guid *guid));
 
 extern int message_parse(const char *fname, struct index_record *record);
+extern int message_parse_guid(const char *fname, struct index_record *record,
+                              const struct message_guid *guid);
 
 struct message_content {
     const char *base;  /* memory mapped file */
@@ -154,6 +157,10 @@ extern int message_parse_binary_file P((FILE *infile, struct body **body));
 extern int message_parse_file P((FILE *infile,
                                  const char **msg_base, size_t *msg_len,
                                  struct body **body));
+extern int message_parse_file_guid P((FILE *infile,
+                                      const char **msg_base, size_t *msg_len,
+                                      struct body **body,
+                                      const struct message_guid *guid));
 extern void message_pruneheader(char *buf, const strarray_t *headers,
                                 const strarray_t *headers_not);
 extern void message_fetch_part P((struct message_content *msg,
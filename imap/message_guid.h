@@ -43,6 +43,8 @@
 #ifndef MESSAGE_GUID_H
 #define MESSAGE_GUID_H
 
+#include "xsha1.h"
+
 /* Public interface */
 
 #define MESSAGE_GUID_SIZE         (20)    /* Size of GUID byte sequence */
@@ -62,6 +64,18 @@ struct message_guid {
 void message_guid_generate(struct message_guid *guid,
                            const char *msg_base, unsigned long msg_len);
 
+/* Generate GUID from a message passed in pieces, e.g. while it is
+ * being written out, so that it needn't be read back to be hashed */
+struct message_guid_ctx {
+    SHA_CTX sha1;
+};
+
+void message_guid_init(struct message_guid_ctx *ctx);
+void message_guid_update(struct message_guid_ctx *ctx,
+                         const char *base, unsigned long len);
+void message_guid_final(struct message_guid_ctx *ctx,
+                        struct message_guid *guid);
+
 /* Copy a GUID */
 void message_guid_copy(struct message_guid *dst, const struct message_guid *src);
 
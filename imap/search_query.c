@@ -313,6 +313,11 @@ static int query_begin_index(search_query_t *query,
         init.userid = query->searchargs->userid;
         init.authstate = query->searchargs->authstate;
         init.out = query->state->out;
+        /* we only read other folders, so unless we have to expunge
+         * them take a shared lock and leave \Recent and \Seen alone.
+         * Concurrent searches and deliveries aren't held off for the
+         * length of a walk over every folder. */
+        init.examine_mode = !query->need_expunge;
 
         r = index_open(mboxname, &init, statep);
         if (r == IMAP_PERMISSION_DENIED) r = IMAP_MAILBOX_NONEXISTENT;
@@ -758,6 +763,13 @@ static int subquery_run_global(search_query_t *query, const char *mboxname)
 static int subquery_run_global_cb(const mbentry_t *mbentry, void *rock)
 {
     search_query_t *query = rock;
+
+    /* index_open() would refuse these anyway, don't bother opening
+     * and locking them just to find that out */
+    if ((mbentry->mbtype & (MBTYPES_NONIMAP|MBTYPE_DELETED|MBTYPE_RESERVE)) &&
+        strcmp(mbentry->name, index_mboxname(query->state)))
+        return 0;
+
     return subquery_run_global(query, mbentry->name);
 }
 
@@ -0,0 +1,98 @@
+/* sortcache.h -- Sort result caching routines
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef SORTCACHE_H
+#define SORTCACHE_H
+
+#include "index.h"
+#include "message_guid.h"
+
+/* name of the sortcache database */
+#define FNAME_SORTCACHEDB "/sortcache.db"
+#define SORTCACHE_VERSION 1
+
+/* open the sortcache db */
+extern void sortcache_open(void);
+
+/* returns nonzero if the result of sorting by 'sortcrit' depends only
+   on immutable message data and so may be cached */
+extern int sortcache_cansort(const struct sortcrit *sortcrit);
+
+/* lookup the cached UID order for 'mboxname' sorted by 'sortcrit'.
+   Returns IMAP_NO_NOSUCHMSG if there is no entry for 'uidvalidity'.
+   On success *last_uidp is the last UID the order knows about, and
+   *uidsp is a new array which must be free()d by the caller */
+extern int sortcache_lookup(const char *mboxname,
+                            const struct sortcrit *sortcrit,
+                            uint32_t uidvalidity, uint32_t *last_uidp,
+                            uint32_t **uidsp, unsigned *nuidsp);
+
+/* store the UID order for 'mboxname' sorted by 'sortcrit', which
+   covers every message up to and including 'last_uid' */
+extern int sortcache_store(const char *mboxname,
+                           const struct sortcrit *sortcrit,
+                           uint32_t uidvalidity, uint32_t last_uid,
+                           const uint32_t *uids, unsigned nuids);
+
+/* lookup a cached response 'what' for 'mboxname', such as the result
+   of a THREAD command.  'uidset' identifies what the response was
+   computed from, such as the search and the messages it matched, and
+   must match the stored value */
+extern int sortcache_lookup_text(const char *mboxname, const char *what,
+                                 uint32_t uidvalidity,
+                                 const struct message_guid *uidset,
+                                 struct buf *text);
+
+/* store a response 'what' for 'mboxname' */
+extern int sortcache_store_text(const char *mboxname, const char *what,
+                                uint32_t uidvalidity,
+                                const struct message_guid *uidset,
+                                const struct buf *text);
+
+/* remove every entry for 'mboxname', when it is deleted or renamed */
+extern void sortcache_delete(const char *mboxname);
+
+/* close the database */
+extern void sortcache_close(void);
+
+#endif /* SORTCACHE_H */
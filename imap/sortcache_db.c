@@ -0,0 +1,373 @@
+/* sortcache_db.c -- Sort result caching routines
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <netinet/in.h>
+
+#include "cyrusdb.h"
+#include "global.h"
+#include "message_guid.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/* generated headers are not necessarily in current directory */
+#include "imap/imap_err.h"
+
+#include "sortcache.h"
+
+#define DB config_sortcache_db
+
+/* Each record is a header of SORTCACHE_HDRWORDS 32-bit words in
+ * network byte order: version, uidvalidity, last_uid and the number
+ * of UIDs, followed by that many UIDs in sorted order.
+ *
+ * Text records start with the version and uidvalidity words, then the
+ * GUID of the set of UIDs the text was computed from, then the text. */
+#define SORTCACHE_HDRWORDS 4
+
+static struct db *sortcachedb;
+static int sortcache_dbopen = 0;
+
+static char *sortcache_filename(void)
+{
+    const char *fname = config_getstring(IMAPOPT_SORTCACHE_DB_PATH);
+
+    if (fname)
+        return xstrdup(fname);
+
+    /* create db file name */
+    return strconcat(config_dir, FNAME_SORTCACHEDB, (char *)NULL);
+}
+
+EXPORTED void sortcache_open(void)
+{
+    char *fname = sortcache_filename();
+    int ret;
+
+    ret = cyrusdb_open(DB, fname, CYRUSDB_CREATE | CYRUSDB_LAZYCOMMIT,
+                       &sortcachedb);
+    if (ret != 0) {
+        syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+               cyrusdb_strerror(ret));
+        syslog(LOG_ERR, "sortcache in degraded mode");
+        goto out;
+    }
+
+    sortcache_dbopen = 1;
+out:
+    free(fname);
+}
+
+EXPORTED void sortcache_close(void)
+{
+    int r;
+
+    if (sortcache_dbopen) {
+        r = cyrusdb_close(sortcachedb);
+        if (r) {
+            syslog(LOG_ERR, "DBERROR: error closing sortcache: %s",
+                   cyrusdb_strerror(r));
+        }
+        sortcache_dbopen = 0;
+    }
+}
+
+EXPORTED int sortcache_cansort(const struct sortcrit *sortcrit)
+{
+    if (!sortcrit) return 0;
+
+    for ( ; sortcrit->key ; sortcrit++) {
+        switch (sortcrit->key) {
+        case SORT_ARRIVAL:
+        case SORT_CC:
+        case SORT_DATE:
+        case SORT_DISPLAYFROM:
+        case SORT_DISPLAYTO:
+        case SORT_FROM:
+        case SORT_SIZE:
+        case SORT_SUBJECT:
+        case SORT_TO:
+        case SORT_UID:
+        case SORT_SPAMSCORE:
+        case SORT_RELEVANCY:
+            break;
+        default:
+            /* flags, annotations, modseqs and conversation data
+             * can all change without a new UID being assigned */
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static const char *sortcache_buildkey(const char *mboxname,
+                                      const char *what, size_t *keylen)
+{
+    static struct buf key = BUF_INITIALIZER;
+
+    buf_setcstr(&key, mboxname);
+    buf_appendcstr(&key, "%%");
+    buf_appendcstr(&key, what);
+
+    *keylen = key.len;
+    return key.s;
+}
+
+static uint32_t sortcache_getword(const char *p, unsigned n)
+{
+    uint32_t w;
+
+    memcpy(&w, p + n * sizeof(uint32_t), sizeof(uint32_t));
+    return ntohl(w);
+}
+
+EXPORTED int sortcache_lookup(const char *mboxname,
+                              const struct sortcrit *sortcrit,
+                              uint32_t uidvalidity, uint32_t *last_uidp,
+                              uint32_t **uidsp, unsigned *nuidsp)
+{
+    size_t keylen, datalen = 0;
+    const char *key, *data = NULL;
+    char *crit;
+    uint32_t *uids;
+    unsigned i, n;
+    int r;
+
+    /* Don't access DB if it hasn't been opened */
+    if (!sortcache_dbopen)
+        return IMAP_NO_NOSUCHMSG;
+
+    crit = sortcrit_as_string(sortcrit);
+    key = sortcache_buildkey(mboxname, crit, &keylen);
+    free(crit);
+
+    do {
+        r = cyrusdb_fetch(sortcachedb, key, keylen, &data, &datalen, NULL);
+    } while (r == CYRUSDB_AGAIN);
+
+    if (r || !data || datalen < SORTCACHE_HDRWORDS * sizeof(uint32_t))
+        return IMAP_NO_NOSUCHMSG;
+
+    if (sortcache_getword(data, 0) != SORTCACHE_VERSION ||
+        sortcache_getword(data, 1) != uidvalidity) {
+        /* stale */
+        return IMAP_NO_NOSUCHMSG;
+    }
+
+    n = sortcache_getword(data, 3);
+    if (datalen != (SORTCACHE_HDRWORDS + n) * sizeof(uint32_t)) {
+        syslog(LOG_ERR, "DBERROR: corrupt sortcache record for %s",
+               mboxname);
+        return IMAP_NO_NOSUCHMSG;
+    }
+
+    uids = xmalloc((n ? n : 1) * sizeof(uint32_t));
+    for (i = 0; i < n; i++)
+        uids[i] = sortcache_getword(data, SORTCACHE_HDRWORDS + i);
+
+    *last_uidp = sortcache_getword(data, 2);
+    *uidsp = uids;
+    *nuidsp = n;
+
+    return 0;
+}
+
+EXPORTED int sortcache_store(const char *mboxname,
+                             const struct sortcrit *sortcrit,
+                             uint32_t uidvalidity, uint32_t last_uid,
+                             const uint32_t *uids, unsigned nuids)
+{
+    size_t keylen;
+    const char *key;
+    char *crit;
+    uint32_t *data;
+    unsigned i;
+    int r;
+
+    /* Don't access DB if it hasn't been opened */
+    if (!sortcache_dbopen)
+        return 0;
+
+    data = xmalloc((SORTCACHE_HDRWORDS + nuids) * sizeof(uint32_t));
+    data[0] = htonl(SORTCACHE_VERSION);
+    data[1] = htonl(uidvalidity);
+    data[2] = htonl(last_uid);
+    data[3] = htonl(nuids);
+    for (i = 0; i < nuids; i++)
+        data[SORTCACHE_HDRWORDS + i] = htonl(uids[i]);
+
+    crit = sortcrit_as_string(sortcrit);
+    key = sortcache_buildkey(mboxname, crit, &keylen);
+    free(crit);
+
+    r = cyrusdb_store(sortcachedb, key, keylen, (const char *)data,
+                      (SORTCACHE_HDRWORDS + nuids) * sizeof(uint32_t), NULL);
+    if (r != CYRUSDB_OK) {
+        syslog(LOG_ERR, "DBERROR: error updating database: %s (%s)",
+               mboxname, cyrusdb_strerror(r));
+    }
+
+    free(data);
+    return r;
+}
+
+EXPORTED int sortcache_lookup_text(const char *mboxname, const char *what,
+                                   uint32_t uidvalidity,
+                                   const struct message_guid *uidset,
+                                   struct buf *text)
+{
+    size_t keylen, datalen = 0;
+    const char *key, *data = NULL;
+    unsigned char guid[MESSAGE_GUID_SIZE];
+    size_t hdrlen = 2 * sizeof(uint32_t) + MESSAGE_GUID_SIZE;
+    int r;
+
+    /* Don't access DB if it hasn't been opened */
+    if (!sortcache_dbopen)
+        return IMAP_NO_NOSUCHMSG;
+
+    key = sortcache_buildkey(mboxname, what, &keylen);
+
+    do {
+        r = cyrusdb_fetch(sortcachedb, key, keylen, &data, &datalen, NULL);
+    } while (r == CYRUSDB_AGAIN);
+
+    if (r || !data || datalen < hdrlen)
+        return IMAP_NO_NOSUCHMSG;
+
+    message_guid_export(uidset, guid);
+    if (sortcache_getword(data, 0) != SORTCACHE_VERSION ||
+        sortcache_getword(data, 1) != uidvalidity ||
+        memcmp(data + 2 * sizeof(uint32_t), guid, MESSAGE_GUID_SIZE)) {
+        /* stale */
+        return IMAP_NO_NOSUCHMSG;
+    }
+
+    buf_setmap(text, data + hdrlen, datalen - hdrlen);
+
+    return 0;
+}
+
+EXPORTED int sortcache_store_text(const char *mboxname, const char *what,
+                                  uint32_t uidvalidity,
+                                  const struct message_guid *uidset,
+                                  const struct buf *text)
+{
+    struct buf data = BUF_INITIALIZER;
+    unsigned char guid[MESSAGE_GUID_SIZE];
+    size_t keylen;
+    const char *key;
+    uint32_t word;
+    int r;
+
+    /* Don't access DB if it hasn't been opened */
+    if (!sortcache_dbopen)
+        return 0;
+
+    word = htonl(SORTCACHE_VERSION);
+    buf_appendmap(&data, (const char *)&word, sizeof(word));
+    word = htonl(uidvalidity);
+    buf_appendmap(&data, (const char *)&word, sizeof(word));
+    message_guid_export(uidset, guid);
+    buf_appendmap(&data, (const char *)guid, MESSAGE_GUID_SIZE);
+    buf_append(&data, text);
+
+    key = sortcache_buildkey(mboxname, what, &keylen);
+
+    r = cyrusdb_store(sortcachedb, key, keylen, data.s, data.len, NULL);
+    if (r != CYRUSDB_OK) {
+        syslog(LOG_ERR, "DBERROR: error updating database: %s (%s)",
+               mboxname, cyrusdb_strerror(r));
+    }
+
+    buf_free(&data);
+    return r;
+}
+
+static int sortcache_deleteone(void *rock,
+                               const char *key, size_t keylen,
+                               const char *data __attribute__((unused)),
+                               size_t datalen __attribute__((unused)))
+{
+    struct txn **tidp = (struct txn **) rock;
+
+    return cyrusdb_delete(sortcachedb, key, keylen, tidp, /*force*/1);
+}
+
+EXPORTED void sortcache_delete(const char *mboxname)
+{
+    struct txn *tid = NULL;
+    size_t keylen;
+    const char *key;
+    int doclose = 0;
+    int r;
+
+    /* mailboxes are deleted and renamed by processes other than
+     * imapd, which don't otherwise use the sortcache */
+    if (!sortcache_dbopen) {
+        if (!config_getswitch(IMAPOPT_SORTCACHE)) return;
+        sortcache_open();
+        if (!sortcache_dbopen) return;
+        doclose = 1;
+    }
+
+    /* every entry for the mailbox shares this prefix */
+    key = sortcache_buildkey(mboxname, "", &keylen);
+
+    r = cyrusdb_foreach(sortcachedb, key, keylen, NULL,
+                        sortcache_deleteone, &tid, &tid);
+    if (!r) r = cyrusdb_commit(sortcachedb, tid);
+    else if (tid) cyrusdb_abort(sortcachedb, tid);
+
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: error deleting sortcache entries: %s (%s)",
+               mboxname, cyrusdb_strerror(r));
+    }
+
+    if (doclose) sortcache_close();
+}
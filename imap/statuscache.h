@@ -47,6 +47,7 @@
 
 /* name of the statuscache database */
 #define FNAME_STATUSCACHEDB "/statuscache.db"
+#define FNAME_STATUSCACHESHM "/statuscache.shm"
 #define STATUSCACHE_VERSION 4
 
 /* Return the filename of the statuscache database,
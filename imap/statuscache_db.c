@@ -51,15 +51,19 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <syslog.h>
 
 #include "assert.h"
+#include "crc32.h"
+#include "cyr_lock.h"
 #include "cyrusdb.h"
 #include "imapd.h"
 #include "global.h"
 #include "mboxlist.h"
 #include "mailbox.h"
+#include "retry.h"
 #include "seen.h"
 #include "util.h"
 #include "xmalloc.h"
@@ -75,6 +79,65 @@
 static struct db *statuscachedb;
 static int statuscache_dbopen = 0;
 
+/*
+ * Shared memory table, used instead of the database when
+ * statuscache_shm_slots is set.
+ *
+ * The file is a header, followed by an array of SHM_GENS * nslots
+ * generation counters and an array of nslots entries.  A mailbox hashes
+ * to one generation counter, which is atomically bumped to invalidate
+ * every cached entry for it (and for any mailbox sharing the counter).
+ * A mailbox+user key hashes to a bucket of SHM_WAYS entries; each entry
+ * records the generation it was filled at and is only valid while that
+ * is still current.
+ *
+ * Entries are protected by a sequence count which is odd while the
+ * entry is being written.  Readers copy the entry and retry nothing:
+ * a torn or busy read is just a cache miss.  Writers that find an
+ * entry busy don't store to it, unless the generation it was being
+ * filled at is no longer current: then its writer most likely died
+ * after taking it, and the entry is taken over rather than left busy
+ * for good.  Writers release an entry with a compare-and-swap, so one
+ * that was overtaken this way can't mark the entry valid again.
+ */
+#define SHM_MAGIC 0x53434d31 /* "SCM1" */
+#define SHM_KEYLEN 224
+#define SHM_GENS 4
+#define SHM_WAYS 4
+
+struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t pad;
+};
+
+struct shm_entry {
+    uint32_t seq;
+    uint32_t statusitems;
+    uint64_t gen;
+    uint32_t messages;
+    uint32_t recent;
+    uint32_t uidnext;
+    uint32_t uidvalidity;
+    uint32_t unseen;
+    uint32_t genslot;
+    uint64_t highestmodseq;
+    char key[SHM_KEYLEN];
+};
+
+static struct {
+    char *base;
+    size_t len;
+    uint32_t nslots;
+    uint64_t *gens;
+    struct shm_entry *entries;
+} statuscache_shm;
+
+#define SHM_SIZE(n) (sizeof(struct shm_header) + \
+                     (n) * (SHM_GENS * sizeof(uint64_t) + \
+                            sizeof(struct shm_entry)))
+
 char *statuscache_filename(void)
 {
     const char *fname = config_getstring(IMAPOPT_STATUSCACHE_DB_PATH);
@@ -86,12 +149,236 @@ char *statuscache_filename(void)
     return strconcat(config_dir, FNAME_STATUSCACHEDB, (char *)NULL);
 }
 
+static void statuscache_shm_open(void)
+{
+    const char *path = config_getstring(IMAPOPT_STATUSCACHE_SHM_PATH);
+    char *fname;
+    struct shm_header *hdr;
+    struct stat sbuf;
+    uint32_t nslots;
+    size_t len;
+    char *base;
+    int fd;
+
+    if (path) fname = xstrdup(path);
+    else fname = strconcat(config_dir, FNAME_STATUSCACHESHM, (char *)NULL);
+
+    fd = open(fname, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+        goto out;
+    }
+
+    if (lock_blocking(fd, fname)) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", fname);
+        goto out;
+    }
+
+    if (fstat(fd, &sbuf) == -1) {
+        syslog(LOG_ERR, "IOERROR: stating %s: %m", fname);
+        goto out;
+    }
+
+    if (!sbuf.st_size) {
+        /* we're first - size it from the config and write the header.
+         * The rest reads as zeros, i.e. empty entries. */
+        struct shm_header newhdr;
+
+        nslots = config_getint(IMAPOPT_STATUSCACHE_SHM_SLOTS);
+        memset(&newhdr, 0, sizeof(newhdr));
+        newhdr.magic = SHM_MAGIC;
+        newhdr.version = STATUSCACHE_VERSION;
+        newhdr.nslots = nslots;
+
+        if (ftruncate(fd, SHM_SIZE(nslots)) == -1 ||
+            retry_write(fd, &newhdr, sizeof(newhdr)) != sizeof(newhdr)) {
+            syslog(LOG_ERR, "IOERROR: initialising %s: %m", fname);
+            goto out;
+        }
+        sbuf.st_size = SHM_SIZE(nslots);
+    }
+
+    len = sbuf.st_size;
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mapping %s: %m", fname);
+        goto out;
+    }
+
+    /* an existing table keeps its size, whatever the config now says */
+    hdr = (struct shm_header *) base;
+    if (len < sizeof(*hdr) || hdr->magic != SHM_MAGIC ||
+        hdr->version != STATUSCACHE_VERSION || !hdr->nslots ||
+        len != SHM_SIZE(hdr->nslots)) {
+        syslog(LOG_ERR, "DBERROR: %s is not a valid statuscache table", fname);
+        munmap(base, len);
+        goto out;
+    }
+
+    statuscache_shm.base = base;
+    statuscache_shm.len = len;
+    statuscache_shm.nslots = hdr->nslots;
+    statuscache_shm.gens = (uint64_t *) (base + sizeof(*hdr));
+    statuscache_shm.entries =
+        (struct shm_entry *) (statuscache_shm.gens + SHM_GENS * hdr->nslots);
+
+out:
+    if (!statuscache_shm.base)
+        syslog(LOG_ERR, "statuscache in degraded mode");
+
+    /* the mapping stays valid after the file is closed */
+    if (fd != -1) {
+        lock_unlock(fd, fname);
+        close(fd);
+    }
+    free(fname);
+}
+
+static uint32_t statuscache_shm_genslot(const char *mboxname)
+{
+    return crc32_cstring(mboxname) % (SHM_GENS * statuscache_shm.nslots);
+}
+
+static uint64_t statuscache_shm_gen(uint32_t genslot)
+{
+    return *(volatile uint64_t *) &statuscache_shm.gens[genslot];
+}
+
+/* returns the first entry of the key's bucket and its size in 'n' */
+static struct shm_entry *statuscache_shm_bucket(const char *key, int *n)
+{
+    uint32_t first = crc32_cstring(key) % statuscache_shm.nslots;
+
+    first -= first % SHM_WAYS;
+    *n = statuscache_shm.nslots - first;
+    if (*n > SHM_WAYS) *n = SHM_WAYS;
+
+    return &statuscache_shm.entries[first];
+}
+
+static int statuscache_shm_lookup(const char *mboxname, const char *key,
+                                  unsigned statusitems,
+                                  struct statusdata *sdata)
+{
+    uint32_t genslot = statuscache_shm_genslot(mboxname);
+    uint64_t gen = statuscache_shm_gen(genslot);
+    struct shm_entry copy;
+    struct shm_entry *bucket;
+    uint32_t seq;
+    int i, n;
+
+    bucket = statuscache_shm_bucket(key, &n);
+
+    for (i = 0; i < n; i++) {
+        volatile struct shm_entry *e = &bucket[i];
+
+        seq = e->seq;
+        if (seq & 1) continue;
+        __sync_synchronize();
+        memcpy(&copy, (const void *) e, sizeof(copy));
+        __sync_synchronize();
+        if (e->seq != seq) continue;
+
+        if (copy.genslot != genslot || copy.gen != gen) continue;
+        if (strncmp(copy.key, key, SHM_KEYLEN)) continue;
+
+        if ((copy.statusitems & statusitems) != statusitems)
+            return IMAP_NO_NOSUCHMSG;
+
+        sdata->statusitems = copy.statusitems;
+        sdata->messages = copy.messages;
+        sdata->recent = copy.recent;
+        sdata->uidnext = copy.uidnext;
+        sdata->uidvalidity = copy.uidvalidity;
+        sdata->unseen = copy.unseen;
+        sdata->highestmodseq = copy.highestmodseq;
+
+        return 0;
+    }
+
+    return IMAP_NO_NOSUCHMSG;
+}
+
+static int statuscache_shm_isstale(const struct shm_entry *e)
+{
+    return e->genslot >= SHM_GENS * statuscache_shm.nslots ||
+           e->gen != statuscache_shm_gen(e->genslot);
+}
+
+static void statuscache_shm_store(const char *mboxname,
+                                  const char *key, size_t keylen,
+                                  struct statusdata *sdata)
+{
+    uint32_t genslot = statuscache_shm_genslot(mboxname);
+    uint64_t gen = statuscache_shm_gen(genslot);
+    struct shm_entry *bucket;
+    struct shm_entry *e = NULL;
+    uint32_t seq, newseq;
+    int i, n;
+
+    assert(keylen < SHM_KEYLEN);
+
+    bucket = statuscache_shm_bucket(key, &n);
+
+    /* reuse our own entry, else an empty or stale one, else any */
+    for (i = 0; i < n; i++) {
+        if (!strncmp(bucket[i].key, key, SHM_KEYLEN)) {
+            e = &bucket[i];
+            break;
+        }
+        if (!e && (!bucket[i].key[0] || statuscache_shm_isstale(&bucket[i])))
+            e = &bucket[i];
+    }
+    if (!e) e = &bucket[gen % n];
+
+    seq = e->seq;
+    if (seq & 1) {
+        /* someone else is writing it: leave it to them, unless what
+         * they're writing is already stale, which means they died */
+        if (!statuscache_shm_isstale(e)) return;
+        newseq = seq + 2;
+    }
+    else newseq = seq + 1;
+
+    if (!__sync_bool_compare_and_swap(&e->seq, seq, newseq))
+        return; /* lost the race for it */
+
+    e->genslot = genslot;
+    e->gen = gen;
+    e->statusitems = sdata->statusitems;
+    e->messages = sdata->messages;
+    e->recent = sdata->recent;
+    e->uidnext = sdata->uidnext;
+    e->uidvalidity = sdata->uidvalidity;
+    e->unseen = sdata->unseen;
+    e->highestmodseq = sdata->highestmodseq;
+    memcpy(e->key, key, keylen + 1);
+
+    /* fails if a later writer took the entry over from us */
+    __sync_bool_compare_and_swap(&e->seq, newseq, newseq + 1);
+}
+
+static void statuscache_shm_close(void)
+{
+    if (statuscache_shm.base)
+        munmap(statuscache_shm.base, statuscache_shm.len);
+    memset(&statuscache_shm, 0, sizeof(statuscache_shm));
+}
+
 EXPORTED void statuscache_open(void)
 {
-    char *fname = statuscache_filename();
+    char *fname;
     int ret;
 
-    ret = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &statuscachedb);
+    if (config_getint(IMAPOPT_STATUSCACHE_SHM_SLOTS)) {
+        statuscache_shm_open();
+        return;
+    }
+
+    fname = statuscache_filename();
+
+    ret = cyrusdb_open(DB, fname, CYRUSDB_CREATE | CYRUSDB_LAZYCOMMIT,
+                       &statuscachedb);
     if (ret != 0) {
         syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
                cyrusdb_strerror(ret));
@@ -108,6 +395,8 @@ EXPORTED void statuscache_close(void)
 {
     int r;
 
+    statuscache_shm_close();
+
     if (statuscache_dbopen) {
         r = cyrusdb_close(statuscachedb);
         if (r) {
@@ -268,6 +557,12 @@ EXPORTED int statuscache_lookup(const char *mboxname, const char *userid,
     char *p, *key = statuscache_buildkey(mboxname, userid, &keylen);
     unsigned version;
 
+    if (statuscache_shm.base) {
+        if (keylen >= SHM_KEYLEN)
+            return IMAP_NO_NOSUCHMSG;
+        return statuscache_shm_lookup(mboxname, key, statusitems, sdata);
+    }
+
     /* Don't access DB if it hasn't been opened */
     if (!statuscache_dbopen)
         return IMAP_NO_NOSUCHMSG;
@@ -389,6 +684,24 @@ HIDDEN int statuscache_invalidate(const char *mboxname, struct statusdata *sdata
     if (!config_getswitch(IMAPOPT_STATUSCACHE))
         return 0;
 
+    if (config_getint(IMAPOPT_STATUSCACHE_SHM_SLOTS)) {
+        /* keep the table mapped, there's no lock to hold */
+        if (!statuscache_shm.base) statuscache_shm_open();
+        if (!statuscache_shm.base) return 0;
+
+        /* invalidate everything for the mailbox before storing */
+        __sync_fetch_and_add(
+            &statuscache_shm.gens[statuscache_shm_genslot(mboxname)], 1);
+
+        if (sdata) {
+            key = statuscache_buildkey(mboxname, sdata->userid, &keylen);
+            if (keylen < SHM_KEYLEN)
+                statuscache_shm_store(mboxname, key, keylen, sdata);
+        }
+
+        return 0;
+    }
+
     /* Open DB if it hasn't been opened */
     if (!statuscache_dbopen) {
         statuscache_open();
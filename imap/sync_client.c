@@ -56,6 +56,7 @@
 #include <fcntl.h>
 #include <syslog.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/wait.h>
 #include <signal.h>
 
@@ -83,6 +84,7 @@
 #include "xstrlcat.h"
 #include "signals.h"
 #include "cyrusdb.h"
+#include "crc32.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -112,6 +114,13 @@ static int no_copyback     = 0;
 
 static char *prev_userid;
 
+/* rolling replication split over several connections (sync_shards) */
+static int sync_nshards    = 1;
+static int sync_shard      = 0;     /* the shard this process handles */
+static pid_t *shard_pids   = NULL;  /* parent: worker for each shard */
+static FILE **shard_cmd    = NULL;  /* parent: log files to process -> */
+static FILE **shard_res    = NULL;  /* parent: <- results */
+
 /* parse_success api is undocumented but my current understanding
  * is that the caller expects it to return a pointer to the position
  * within str at which base64 encoded "success data" can be found.
@@ -393,6 +402,33 @@ static int do_restart()
     return sync_parse_response("RESTART", sync_in, NULL);
 }
 
+/*
+ * Choose the shard for a sync log item.  Everything for one user is
+ * kept on one shard, so it is replicated in the order it was logged,
+ * and a rename within a user's mailboxes still looks like a rename to
+ * the replica.  Shared mailboxes all go to shard 0.
+ */
+static int item_shard(const char *args[3])
+{
+    const char *key = args[1];
+    char *userid = NULL;
+    int shard;
+
+    if (!strcmp(args[0], "APPEND") || !strcmp(args[0], "MAILBOX") ||
+        !strcmp(args[0], "UNMAILBOX") || !strcmp(args[0], "QUOTA") ||
+        !strcmp(args[0], "ANNOTATION")) {
+        /* mailbox name */
+        userid = mboxname_to_userid(args[1]);
+        key = userid;
+    }
+    /* all other items start with the userid */
+
+    shard = (key && *key) ? crc32_cstring(key) % sync_nshards : 0;
+    free(userid);
+
+    return shard;
+}
+
 static int do_sync(sync_log_reader_t *slr)
 {
     struct sync_action_list *user_list = sync_action_list_create();
@@ -413,6 +449,10 @@ static int do_sync(sync_log_reader_t *slr)
         r = sync_log_reader_getitem(slr, args);
         if (r == EOF) break;
 
+        /* another shard's business? */
+        if (sync_nshards > 1 && item_shard(args) != sync_shard)
+            continue;
+
         if (!strcmp(args[0], "USER"))
             sync_action_list_add(user_list, NULL, args[1]);
         else if (!strcmp(args[0], "UNUSER"))
@@ -666,6 +706,10 @@ static int do_sync_filename(const char *filename)
 
 /* ====================================================================== */
 
+static int do_sync_shards(sync_log_reader_t *slr);
+static void shards_send(const char *line);
+static int shards_wait(int r);
+
 enum {
     RESTART_NONE = 0,
     RESTART_NORMAL,
@@ -718,7 +762,7 @@ static int do_daemon_work(const char *channel, const char *sync_shutdown_file,
         }
 
         /* Process the work log */
-        if ((r=do_sync(slr))) {
+        if ((r=do_sync_shards(slr))) {
             syslog(LOG_ERR,
                    "Processing sync log file %s failed: %s",
                    sync_log_reader_get_file_name(slr), error_message(r));
@@ -736,7 +780,10 @@ static int do_daemon_work(const char *channel, const char *sync_shutdown_file,
     sync_log_reader_free(slr);
 
     if (*restartp == RESTART_NORMAL) {
+        /* each worker's connection has its own reserved files too */
+        if (sync_nshards > 1) shards_send("RESTART");
         r = do_restart();
+        if (sync_nshards > 1) r = shards_wait(r);
         if (r) {
             syslog(LOG_ERR, "sync_client RESTART failed: %s",
                    error_message(r));
@@ -764,6 +811,8 @@ static int get_intconfig(const char *channel, const char *val)
     if (response == -1) {
         if (!strcmp(val, "sync_repeat_interval"))
             response = config_getint(IMAPOPT_SYNC_REPEAT_INTERVAL);
+        else if (!strcmp(val, "sync_shards"))
+            response = config_getint(IMAPOPT_SYNC_SHARDS);
     }
 
     return response;
@@ -959,6 +1008,228 @@ static void replica_disconnect(void)
     backend_disconnect(sync_backend);
 }
 
+/* ====================================================================== */
+
+/*
+ * Rolling replication over several connections.  The parent reads each
+ * sync log as usual and handles shard 0 itself, while a worker process
+ * with its own replica connection handles each of the others, reading
+ * the same log file and skipping the items which aren't its own.
+ *
+ * Each line the parent sends a worker is either the (absolute) name of
+ * a sync log file, or RESTART or RECONNECT to have the worker do the
+ * same to its own connection as the parent has just done to its one.
+ * The worker answers every line with a result code.
+ */
+
+static void shard_worker(const char *channel, int cmdfd, int resfd)
+{
+    FILE *in = fdopen(cmdfd, "r");
+    FILE *out = fdopen(resfd, "w");
+    char fname[MAX_MAILBOX_PATH+1];
+
+    replica_connect(channel);
+
+    while (fgets(fname, sizeof(fname), in)) {
+        struct timeval start, end;
+        int r;
+
+        fname[strcspn(fname, "\n")] = '\0';
+
+        if (!strcmp(fname, "RESTART")) {
+            r = do_restart();
+            if (r) {
+                syslog(LOG_ERR, "sync shard %d: RESTART failed: %s",
+                       sync_shard, error_message(r));
+            }
+            fprintf(out, "%d\n", r);
+            fflush(out);
+            continue;
+        }
+        if (!strcmp(fname, "RECONNECT")) {
+            replica_disconnect();
+            replica_connect(channel);
+            fprintf(out, "%d\n", 0);
+            fflush(out);
+            continue;
+        }
+
+        gettimeofday(&start, NULL);
+        r = do_sync_filename(fname);
+        gettimeofday(&end, NULL);
+
+        if (verbose_logging) {
+            syslog(LOG_INFO, "sync shard %d: %s took %.3f seconds: %s",
+                   sync_shard, fname, timesub(&start, &end),
+                   r ? error_message(r) : "ok");
+        }
+
+        if (r && backend_ping(sync_backend, NULL)) {
+            /* lost the replica: start again with a new connection */
+            replica_disconnect();
+            replica_connect(channel);
+        }
+
+        fprintf(out, "%d\n", r);
+        fflush(out);
+    }
+
+    replica_disconnect();
+    fclose(in);
+    fclose(out);
+}
+
+/* start a worker for each shard which doesn't have one */
+static void shards_start(const char *channel)
+{
+    int n, i;
+
+    if (!shard_pids) {
+        shard_pids = xzmalloc(sync_nshards * sizeof(pid_t));
+        shard_cmd = xzmalloc(sync_nshards * sizeof(FILE *));
+        shard_res = xzmalloc(sync_nshards * sizeof(FILE *));
+    }
+
+    for (n = 1; n < sync_nshards; n++) {
+        int cmdfds[2], resfds[2];
+
+        if (shard_pids[n] > 0) continue;
+
+        if (pipe(cmdfds) < 0) {
+            syslog(LOG_ERR, "IOERROR: pipe for sync shard %d: %m", n);
+            continue;
+        }
+        if (pipe(resfds) < 0) {
+            syslog(LOG_ERR, "IOERROR: pipe for sync shard %d: %m", n);
+            close(cmdfds[0]);
+            close(cmdfds[1]);
+            continue;
+        }
+
+        fflush(NULL);
+        shard_pids[n] = fork();
+        if (shard_pids[n] < 0) {
+            syslog(LOG_ERR, "IOERROR: fork for sync shard %d: %m", n);
+            shard_pids[n] = 0;
+            close(cmdfds[0]); close(cmdfds[1]);
+            close(resfds[0]); close(resfds[1]);
+            continue;
+        }
+
+        if (shard_pids[n] == 0) {
+            /* worker: drop the parent's ends of the other workers' pipes */
+            for (i = 1; i < sync_nshards; i++) {
+                if (shard_cmd[i]) fclose(shard_cmd[i]);
+                if (shard_res[i]) fclose(shard_res[i]);
+            }
+            close(cmdfds[1]);
+            close(resfds[0]);
+
+            sync_shard = n;
+            shard_worker(channel, cmdfds[0], resfds[1]);
+            _exit(0);
+        }
+
+        close(cmdfds[0]);
+        close(resfds[1]);
+        shard_cmd[n] = fdopen(cmdfds[1], "w");
+        shard_res[n] = fdopen(resfds[0], "r");
+    }
+}
+
+static void shard_reap(int n)
+{
+    if (shard_cmd[n]) fclose(shard_cmd[n]);
+    if (shard_res[n]) fclose(shard_res[n]);
+    shard_cmd[n] = shard_res[n] = NULL;
+
+    if (shard_pids[n] > 0) {
+        while (waitpid(shard_pids[n], NULL, 0) < 0 && errno == EINTR);
+    }
+    shard_pids[n] = 0;
+}
+
+static void shards_stop(void)
+{
+    int n;
+
+    if (!shard_pids) return;
+
+    /* closing their input tells the workers to finish */
+    for (n = 1; n < sync_nshards; n++)
+        shard_reap(n);
+
+    free(shard_pids);
+    free(shard_cmd);
+    free(shard_res);
+    shard_pids = NULL;
+    shard_cmd = shard_res = NULL;
+}
+
+/* pass a sync log file name or a command to every worker */
+static void shards_send(const char *line)
+{
+    int n;
+
+    for (n = 1; n < sync_nshards; n++) {
+        if (!shard_cmd[n]) continue;
+        fprintf(shard_cmd[n], "%s\n", line);
+        fflush(shard_cmd[n]);
+    }
+}
+
+/* wait for every worker to answer, returning the first failure */
+static int shards_wait(int r)
+{
+    int n;
+
+    for (n = 1; n < sync_nshards; n++) {
+        char buf[64];
+        int r2 = IMAP_IOERROR;
+
+        if (shard_res[n] && fgets(buf, sizeof(buf), shard_res[n]))
+            r2 = atoi(buf);
+        else {
+            syslog(LOG_ERR, "sync shard %d has gone away", n);
+            shard_reap(n);
+        }
+        if (!r) r = r2;
+    }
+
+    return r;
+}
+
+/*
+ * Process a sync log over all the shards, returning once they have all
+ * finished with it.  Any shard failing fails the whole log, which is
+ * then processed again from the start, exactly as with one connection.
+ */
+static int do_sync_shards(sync_log_reader_t *slr)
+{
+    const char *fname = sync_log_reader_get_file_name(slr);
+    struct timeval start, mine, end;
+    int r;
+
+    if (sync_nshards <= 1) return do_sync(slr);
+
+    shards_send(fname);
+
+    gettimeofday(&start, NULL);
+    r = do_sync(slr);
+    gettimeofday(&mine, NULL);
+
+    r = shards_wait(r);
+    gettimeofday(&end, NULL);
+
+    if (verbose_logging) {
+        syslog(LOG_INFO, "sync shards: %s took %.3f seconds"
+               " (%.3f seconds waiting for other shards)",
+               fname, timesub(&start, &end), timesub(&mine, &end));
+    }
+
+    return r;
+}
+
 static void do_daemon(const char *channel, const char *sync_shutdown_file,
                       unsigned long timeout, unsigned long min_delta)
 {
@@ -967,7 +1238,11 @@ static void do_daemon(const char *channel, const char *sync_shutdown_file,
 
     signal(SIGPIPE, SIG_IGN); /* don't fail on server disconnects */
 
+    sync_nshards = get_intconfig(channel, "sync_shards");
+    if (sync_nshards < 1) sync_nshards = 1;
+
     while (restart) {
+        if (sync_nshards > 1) shards_start(channel);
         replica_connect(channel);
         r = do_daemon_work(channel, sync_shutdown_file,
                            timeout, min_delta, &restart);
@@ -976,10 +1251,19 @@ static void do_daemon(const char *channel, const char *sync_shutdown_file,
              * If we are, we had some type of error, so we exit.
              * Otherwise, try reconnecting.
              */
-            if (!backend_ping(sync_backend, NULL)) restart = 1;
+            if (!backend_ping(sync_backend, NULL)) {
+                restart = RESTART_RECONNECT;
+                /* the workers start again with new connections too */
+                if (sync_nshards > 1) {
+                    shards_send("RECONNECT");
+                    shards_wait(0);
+                }
+            }
         }
         replica_disconnect();
     }
+
+    shards_stop();
 }
 
 static int do_mailbox(const char *mboxname, unsigned flags)
@@ -62,6 +62,7 @@
 #include "sync_log.h"
 #include "global.h"
 #include "cyr_lock.h"
+#include "hash.h"
 #include "mailbox.h"
 #include "retry.h"
 #include "util.h"
@@ -75,6 +76,11 @@ static int sync_log_suppressed = 0;
 static strarray_t *channels = NULL;
 static strarray_t *unsuppressable = NULL;
 
+/* entries held back since the last sync_log_flush(), if buffering */
+static int sync_log_buffered = 0;
+static struct buf pending = BUF_INITIALIZER;
+static hash_table pending_seen = HASH_TABLE_INITIALIZER;
+
 EXPORTED void sync_log_init(void)
 {
     const char *conf;
@@ -111,6 +117,11 @@ EXPORTED void sync_log_suppress(void)
 
 EXPORTED void sync_log_done(void)
 {
+    sync_log_flush();
+    if (pending_seen.size) free_hash_table(&pending_seen, NULL);
+    buf_free(&pending);
+    sync_log_buffered = 0;
+
     strarray_free(channels);
     channels = NULL;
 
@@ -302,10 +313,57 @@ EXPORTED void sync_log(const char *fmt, ...)
     val = va_format(fmt, ap);
     va_end(ap);
 
+    if (sync_log_buffered) {
+        /* each entry only needs to be written once per flush */
+        if (!hash_lookup(val, &pending_seen)) {
+            hash_insert(val, (void *) 1, &pending_seen);
+            buf_appendcstr(&pending, val);
+        }
+        /* a mailbox change has already been committed by the time it's
+         * logged, so don't hold it back where a crash would lose it */
+        if (!strncmp(val, "MAILBOX ", 8) || !strncmp(val, "UNMAILBOX ", 10) ||
+            !strncmp(val, "APPEND ", 7))
+            sync_log_flush();
+        return;
+    }
+
     for (i = 0 ; i < channels->count ; i++)
         sync_log_base(channels->data[i], val);
 }
 
+/*
+ * Hold back sync_log() entries until the next sync_log_flush() (or
+ * sync_log_done()), dropping duplicates, so that a command which makes
+ * many changes logs each once, with a single lock and write of each
+ * channel's log.  MAILBOX, UNMAILBOX and APPEND entries still flush
+ * straight away, taking anything held back with them.  Called by
+ * services which flush at the end of every command, when
+ * sync_log_buffer is enabled.
+ */
+EXPORTED void sync_log_buffer(void)
+{
+    if (!config_getswitch(IMAPOPT_SYNC_LOG_BUFFER)) return;
+
+    if (!pending_seen.size) construct_hash_table(&pending_seen, 256, 0);
+    sync_log_buffered = 1;
+}
+
+EXPORTED void sync_log_flush(void)
+{
+    int i;
+
+    if (!pending.len) return;
+
+    if (channels) {
+        for (i = 0 ; i < channels->count ; i++)
+            sync_log_base(channels->data[i], buf_cstring(&pending));
+    }
+
+    buf_reset(&pending);
+    free_hash_table(&pending_seen, NULL);
+    construct_hash_table(&pending_seen, 256, 0);
+}
+
 EXPORTED void sync_log_channel(const char *channel, const char *fmt, ...)
 {
     va_list ap;
@@ -353,6 +411,8 @@ struct sync_log_reader
     struct buf type;
     struct buf arg1;
     struct buf arg2;
+    hash_table seen;    /* items already returned from this file */
+    struct buf key;
 };
 
 static sync_log_reader_t *sync_log_reader_alloc(void)
@@ -424,6 +484,8 @@ EXPORTED void sync_log_reader_free(sync_log_reader_t *slr)
     buf_free(&slr->type);
     buf_free(&slr->arg1);
     buf_free(&slr->arg2);
+    if (slr->seen.size) free_hash_table(&slr->seen, NULL);
+    buf_free(&slr->key);
     free(slr);
 }
 
@@ -451,16 +513,19 @@ EXPORTED int sync_log_reader_begin(sync_log_reader_t *slr)
         if (r) return r;
     }
 
-    if (stat(slr->work_file, &sbuf) == 0) {
+    if (!slr->log_file) {
+        /* a file (or descriptor) we were given: just read it */
+        if (slr->work_file && stat(slr->work_file, &sbuf) < 0) {
+            syslog(LOG_ERR, "Failed to stat %s: %m",
+                   slr->work_file);
+            return IMAP_IOERROR;
+        }
+    }
+    else if (stat(slr->work_file, &sbuf) == 0) {
         /* Existing work log file - process this first */
         syslog(LOG_NOTICE,
                "Reprocessing sync log file %s", slr->work_file);
     }
-    else if (!slr->log_file) {
-        syslog(LOG_ERR, "Failed to stat %s: %m",
-               slr->log_file);
-        return IMAP_IOERROR;
-    }
     else {
         /* Check for sync_log file */
         if (stat(slr->log_file, &sbuf) < 0) {
@@ -504,6 +569,9 @@ EXPORTED int sync_log_reader_begin(sync_log_reader_t *slr)
 
     slr->input = prot_new(slr->fd, /*write*/0);
 
+    if (slr->seen.size) free_hash_table(&slr->seen, NULL);
+    construct_hash_table(&slr->seen, 4096, 0);
+
     return 0;
 }
 
@@ -597,10 +665,20 @@ EXPORTED int sync_log_reader_getitem(sync_log_reader_t *slr,
             continue;
         }
 
+        /* a busy mailbox is logged over and over, but everything in
+         * the file was logged before we started reading it, so acting
+         * on the first entry covers the rest */
+        ucase(slr->type.s);
+        buf_reset(&slr->key);
+        buf_printf(&slr->key, "%s\t%s\t%s", slr->type.s,
+                   arg1s ? arg1s : "", arg2s ? arg2s : "");
+        if (hash_lookup(buf_cstring(&slr->key), &slr->seen))
+            continue;
+        hash_insert(buf_cstring(&slr->key), (void *) 1, &slr->seen);
+
         break;
     }
 
-    ucase(slr->type.s);
     args[0] = slr->type.s;
     args[1] = arg1s;
     args[2] = arg2s;
@@ -51,6 +51,8 @@
 void sync_log_init(void);
 void sync_log_suppress(void);
 void sync_log_done(void);
+void sync_log_buffer(void);
+void sync_log_flush(void);
 
 void sync_log(const char *fmt, ...);
 void sync_log_channel(const char *channel, const char *fmt, ...);
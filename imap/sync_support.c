@@ -1181,6 +1181,7 @@ struct sync_action_list *sync_action_list_create(void)
     l->head   = NULL;
     l->tail   = NULL;
     l->count  = 0;
+    construct_hash_table(&l->index, 1024, 0);
 
     return(l);
 }
@@ -1189,17 +1190,19 @@ void sync_action_list_add(struct sync_action_list *l,
                           const char *name, const char *user)
 {
     struct sync_action *current;
+    struct buf key = BUF_INITIALIZER;
 
     if (!name && !user) return;
 
-    for (current = l->head ; current ; current = current->next) {
-        if ((!name || (current->name && !strcmp(current->name, name))) &&
-            (!user || (current->user && !strcmp(current->user, user)))) {
-            current->active = 1;  /* Make sure active */
-            return;
-        } else {
-            /* name and/or user don't match current: no match possible */
-        }
+    /* each list is always given the same kind of action, so name and
+     * user together find a duplicate without walking the whole list */
+    buf_printf(&key, "%s\t%s", name ? name : "", user ? user : "");
+
+    current = hash_lookup(buf_cstring(&key), &l->index);
+    if (current) {
+        current->active = 1;  /* Make sure active */
+        buf_free(&key);
+        return;
     }
 
     current           = xzmalloc(sizeof(struct sync_action));
@@ -1215,6 +1218,8 @@ void sync_action_list_add(struct sync_action_list *l,
 
     l->count++;
 
+    hash_insert(buf_cstring(&key), current, &l->index);
+    buf_free(&key);
 }
 
 void sync_action_list_free(struct sync_action_list **lp)
@@ -1232,6 +1237,7 @@ void sync_action_list_free(struct sync_action_list **lp)
         free(current);
         current = next;
     }
+    free_hash_table(&l->index, NULL);
     free(l);
     *lp = NULL;
 }
@@ -1344,7 +1350,7 @@ static int sync_prepare_dlists(struct mailbox *mailbox,
                                const char *topart,
                                struct sync_msgid_list *part_list,
                                struct dlist *kl, struct dlist *kupload,
-                               int printrecords)
+                               int printrecords, struct seqset *uids)
 {
     struct sync_annot_list *annots = NULL;
     struct synccrcs synccrcs = mailbox_synccrcs(mailbox, /*force*/0);
@@ -1396,6 +1402,10 @@ static int sync_prepare_dlists(struct mailbox *mailbox,
             /* start off thinking we're sending the file too */
             int send_file = 1;
 
+            /* only the requested records */
+            if (uids && !seqset_ismember(uids, record->uid))
+                continue;
+
             /* does it exist at the other end?  Don't send it */
             if (remote && record->uid <= remote->last_uid)
                 send_file = 0;
@@ -1530,6 +1540,9 @@ int sync_append_copyfile(struct mailbox *mailbox,
 
     if (!item || !item->fname)
         r = IMAP_IOERROR;
+    else if (item->is_verified)
+        /* already hashed when it was uploaded */
+        r = message_parse_guid(item->fname, record, &item->guid);
     else
         r = message_parse(item->fname, record);
 
@@ -1568,6 +1581,8 @@ int sync_append_copyfile(struct mailbox *mailbox,
         return r;
     }
 
+    mailbox_guidstore_link(mailbox, record);
+
  just_write:
     r = mailbox_append_index_record(mailbox, record);
     if (r) return r;
@@ -2517,7 +2532,7 @@ static int mailbox_byname(const char *name, void *rock)
          !sync_name_lookup(qrl, mailbox->quotaroot))
         sync_name_list_add(qrl, mailbox->quotaroot);
 
-    r = sync_prepare_dlists(mailbox, NULL, NULL, NULL, kl, NULL, 0);
+    r = sync_prepare_dlists(mailbox, NULL, NULL, NULL, kl, NULL, 0, NULL);
     if (!r) sync_send_response(kl, mrock->pout);
 
 out:
@@ -2536,25 +2551,103 @@ int sync_get_fullmailbox(struct dlist *kin, struct sync_state *sstate)
 {
     struct mailbox *mailbox = NULL;
     struct dlist *kl = dlist_newkvlist(NULL, "MAILBOX");
+    const char *mboxname = kin->sval;
+    const char *uidlist = NULL;
+    struct seqset *uids = NULL;
     int r;
 
+    /* either just the name, or the name and the UIDs to send */
+    if (dlist_iskvlist(kin)) {
+        if (!dlist_getatom(kin, "MBOXNAME", &mboxname)) {
+            r = IMAP_PROTOCOL_BAD_PARAMETERS;
+            goto out;
+        }
+        if (dlist_getatom(kin, "UIDS", &uidlist))
+            uids = seqset_parse(uidlist, NULL, 0);
+    }
+
     /* XXX again - this is a read-only request, but we
      * don't have a good way to express that, so we use
      * write locks anyway */
-    r = mailbox_open_iwl(kin->sval, &mailbox);
+    r = mailbox_open_iwl(mboxname, &mailbox);
     if (r) goto out;
 
-    r = sync_prepare_dlists(mailbox, NULL, NULL, NULL, kl, NULL, 1);
+    r = sync_prepare_dlists(mailbox, NULL, NULL, NULL, kl, NULL, 1, uids);
     if (r) goto out;
 
     sync_send_response(kl, sstate->pout);
 
 out:
+    seqset_free(uids);
     dlist_free(&kl);
     mailbox_close(&mailbox);
     return r;
 }
 
+/* the most UID ranges a single CRCRANGES request may ask about */
+#define SYNC_CRCRANGES_MAX 65536
+
+int sync_get_crcranges(struct dlist *kin, struct sync_state *sstate)
+{
+    struct mailbox *mailbox = NULL;
+    struct dlist *kl = NULL;
+    struct dlist *ranges = NULL;
+    struct dlist *crcl;
+    struct dlist *ki;
+    const char *mboxname = NULL;
+    uint32_t *first = NULL;
+    uint32_t *last = NULL;
+    struct synccrcs *crcs = NULL;
+    int i, n = 0;
+    int r;
+
+    if (!dlist_getatom(kin, "MBOXNAME", &mboxname) ||
+        !dlist_getlist(kin, "RANGES", &ranges))
+        return IMAP_PROTOCOL_BAD_PARAMETERS;
+
+    /* RANGES is a flat list of first,last UID pairs in ascending order */
+    for (ki = ranges->head; ki; ki = ki->next) n++;
+    if (n % 2 || n / 2 > SYNC_CRCRANGES_MAX)
+        return IMAP_PROTOCOL_BAD_PARAMETERS;
+    n /= 2;
+
+    first = xmalloc(n * sizeof(uint32_t));
+    last = xmalloc(n * sizeof(uint32_t));
+    crcs = xmalloc(n * sizeof(struct synccrcs));
+    for (i = 0, ki = ranges->head; i < n; i++, ki = ki->next->next) {
+        first[i] = dlist_num(ki);
+        last[i] = dlist_num(ki->next);
+        if (last[i] < first[i] || (i && first[i] <= last[i-1])) {
+            r = IMAP_PROTOCOL_BAD_PARAMETERS;
+            goto out;
+        }
+    }
+
+    r = mailbox_open_irl(mboxname, &mailbox);
+    if (r) goto out;
+
+    r = mailbox_synccrcs_ranges(mailbox, n, first, last, crcs);
+    if (r) goto out;
+
+    kl = dlist_newkvlist(NULL, "CRCRANGES");
+    dlist_setatom(kl, "MBOXNAME", mailbox->name);
+    crcl = dlist_newlist(kl, "CRCS");
+    for (i = 0; i < n; i++) {
+        dlist_setnum32(crcl, "SYNC_CRC", crcs[i].basic);
+        dlist_setnum32(crcl, "SYNC_CRC_ANNOT", crcs[i].annot);
+    }
+
+    sync_send_response(kl, sstate->pout);
+
+out:
+    mailbox_close(&mailbox);
+    dlist_free(&kl);
+    free(first);
+    free(last);
+    free(crcs);
+    return r;
+}
+
 int sync_get_mailboxes(struct dlist *kin, struct sync_state *sstate)
 {
     struct dlist *ki;
@@ -3121,7 +3214,10 @@ int sync_apply_message(struct dlist *kin,
             continue;
 
         msgid->size = size;
-        if (!msgid->fname) msgid->fname = xstrdup(fname);
+        if (!msgid->fname) {
+            msgid->fname = xstrdup(fname);
+            msgid->is_verified = ki->verified;
+        }
         msgid->need_upload = 0;
         part_list->toupload--;
     }
@@ -3906,7 +4002,10 @@ static int fetch_file(struct mailbox *mailbox, unsigned uid,
         msgid = sync_msgid_insert(part_list, &rp->guid);
         msgid->need_upload = 1;
         msgid->size = size;
-        if (!msgid->fname) msgid->fname = xstrdup(fname);
+        if (!msgid->fname) {
+            msgid->fname = xstrdup(fname);
+            msgid->is_verified = kin->head->verified;
+        }
     }
     else {
         r = IMAP_MAILBOX_NONEXISTENT;
@@ -4187,13 +4286,28 @@ static int compare_one_record(struct mailbox *mailbox,
     return mailbox_rewrite_index_record(mailbox, mp);
 }
 
+/* next master record, skipping any outside @uids */
+static const struct index_record *update_loop_step(struct mailbox_iter *iter,
+                                                   struct seqset *uids)
+{
+    const struct index_record *record;
+
+    while ((record = mailbox_iter_step(iter))) {
+        if (!uids || seqset_ismember(uids, record->uid))
+            break;
+    }
+
+    return record;
+}
+
 static int mailbox_update_loop(struct mailbox *mailbox,
                                struct dlist *ki,
                                uint32_t last_uid,
                                modseq_t highestmodseq,
                                struct dlist *kaction,
                                struct sync_msgid_list *part_list,
-                               struct backend *sync_be)
+                               struct backend *sync_be,
+                               struct seqset *uids)
 {
     const struct index_record *mrecord;
     struct index_record rrecord;
@@ -4202,7 +4316,7 @@ static int mailbox_update_loop(struct mailbox *mailbox,
     int r;
 
     struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, 0);
-    mrecord = mailbox_iter_step(iter);
+    mrecord = update_loop_step(iter, uids);
 
     /* while there are more records on either master OR replica,
      * work out what to do with them */
@@ -4227,7 +4341,7 @@ static int mailbox_update_loop(struct mailbox *mailbox,
                                        sync_be);
                 if (r) goto out;
                 /* increment both */
-                mrecord = mailbox_iter_step(iter);
+                mrecord = update_loop_step(iter, uids);
                 ki = ki->next;
             }
             else if (rrecord.uid > mrecord->uid) {
@@ -4240,7 +4354,7 @@ static int mailbox_update_loop(struct mailbox *mailbox,
                     if (r) goto out;
                 }
                 /* only increment master */
-                mrecord = mailbox_iter_step(iter);
+                mrecord = update_loop_step(iter, uids);
             }
             else {
                 /* record only exists on the replica */
@@ -4274,7 +4388,7 @@ static int mailbox_update_loop(struct mailbox *mailbox,
                     if (r) goto out;
                 }
             }
-            mrecord = mailbox_iter_step(iter);
+            mrecord = update_loop_step(iter, uids);
         }
 
         /* record only exists on the replica */
@@ -4302,6 +4416,163 @@ out:
     return r;
 }
 
+/* how many pieces each differing UID range is split into */
+#define SYNC_CRCRANGES_SPLIT 16
+/* ranges spanning at most this many UIDs are fetched, not split */
+#define SYNC_CRCRANGES_MINUIDS 256
+/* fetch the whole mailbox if more ranges than this still differ */
+#define SYNC_CRCRANGES_MAXDIFF 1024
+
+/*
+ * Narrow down which UIDs of @local differ from the replica by asking
+ * for the sync CRCs of UID ranges, splitting each range which differs
+ * and asking again until the ranges are small.  On success @uids holds
+ * a sequence covering just the differing UIDs.  Returns non-zero if the
+ * whole mailbox should be fetched instead: the mailbox is small, the
+ * replica doesn't support CRCRANGES, or the differences are spread too
+ * widely to be worth it.
+ */
+static int find_changed_uids(struct sync_folder *local,
+                             struct backend *sync_be,
+                             struct buf *uids)
+{
+    struct mailbox *mailbox = NULL;
+    struct dlist *kl = NULL;
+    struct dlist *kin = NULL;
+    struct dlist *ki;
+    /* ranges known to differ, still to be split */
+    uint32_t *tfirst = NULL, *tlast = NULL;
+    /* ranges being asked about this round */
+    uint32_t *qfirst = NULL, *qlast = NULL;
+    struct synccrcs *crcs = NULL;
+    int ntodo, nq, ndiff = 0;
+    uint32_t top;
+    int i;
+    int r = 0;
+
+    buf_reset(uids);
+
+    if (local->mailbox) mailbox = local->mailbox;
+    else r = mailbox_open_irl(local->name, &mailbox);
+    if (r) return r;
+
+    if (mailbox->i.num_records <= SYNC_CRCRANGES_MINUIDS) {
+        r = IMAP_AGAIN;
+        goto done;
+    }
+
+    /* the whole mailbox differs - the last range is open ended
+     * to cover any UIDs only the replica has */
+    top = mailbox->i.last_uid;
+    tfirst = xmalloc(sizeof(uint32_t));
+    tlast = xmalloc(sizeof(uint32_t));
+    tfirst[0] = 1;
+    tlast[0] = UINT32_MAX;
+    ntodo = 1;
+
+    while (ntodo) {
+        qfirst = xmalloc(ntodo * SYNC_CRCRANGES_SPLIT * sizeof(uint32_t));
+        qlast = xmalloc(ntodo * SYNC_CRCRANGES_SPLIT * sizeof(uint32_t));
+        nq = 0;
+
+        for (i = 0; i < ntodo; i++) {
+            uint32_t hi = tlast[i] == UINT32_MAX ?
+                          MAX(tfirst[i], top) : tlast[i];
+            uint32_t span = hi - tfirst[i] + 1;
+            uint32_t step = (span + SYNC_CRCRANGES_SPLIT - 1) / SYNC_CRCRANGES_SPLIT;
+            uint32_t lo;
+
+            if (span <= SYNC_CRCRANGES_MINUIDS) {
+                /* small enough, fetch all its records */
+                buf_printf(uids, "%s%u:", ndiff ? "," : "", tfirst[i]);
+                if (tlast[i] == UINT32_MAX) buf_putc(uids, '*');
+                else buf_printf(uids, "%u", tlast[i]);
+                ndiff++;
+                continue;
+            }
+
+            for (lo = tfirst[i]; lo <= hi; lo += step) {
+                qfirst[nq] = lo;
+                qlast[nq] = hi - lo < step ? tlast[i] : lo + step - 1;
+                nq++;
+                if (qlast[nq-1] >= hi) break;
+            }
+        }
+
+        free(tfirst);
+        free(tlast);
+        tfirst = tlast = NULL;
+        ntodo = 0;
+
+        if (!nq) break;
+
+        crcs = xmalloc(nq * sizeof(struct synccrcs));
+        r = mailbox_synccrcs_ranges(mailbox, nq, qfirst, qlast, crcs);
+        if (r) goto done;
+
+        kl = dlist_newkvlist(NULL, "CRCRANGES");
+        dlist_setatom(kl, "MBOXNAME", mailbox->name);
+        ki = dlist_newlist(kl, "RANGES");
+        for (i = 0; i < nq; i++) {
+            dlist_setnum32(ki, "FIRST", qfirst[i]);
+            dlist_setnum32(ki, "LAST", qlast[i]);
+        }
+        sync_send_lookup(kl, sync_be->out);
+        dlist_free(&kl);
+
+        r = sync_parse_response("CRCRANGES", sync_be->in, &kin);
+        if (r) goto done;
+
+        if (!kin->head || !dlist_getlist(kin->head, "CRCS", &ki)) {
+            r = IMAP_PROTOCOL_BAD_PARAMETERS;
+            goto done;
+        }
+
+        /* keep the ranges whose CRCs differ for the next round */
+        tfirst = xmalloc(nq * sizeof(uint32_t));
+        tlast = xmalloc(nq * sizeof(uint32_t));
+        for (i = 0, ki = ki->head; i < nq; i++) {
+            if (!ki || !ki->next) {
+                r = IMAP_PROTOCOL_BAD_PARAMETERS;
+                goto done;
+            }
+            if (dlist_num(ki) != crcs[i].basic ||
+                dlist_num(ki->next) != crcs[i].annot) {
+                tfirst[ntodo] = qfirst[i];
+                tlast[ntodo] = qlast[i];
+                ntodo++;
+            }
+            ki = ki->next->next;
+        }
+
+        if (ndiff + ntodo > SYNC_CRCRANGES_MAXDIFF) {
+            r = IMAP_AGAIN;
+            goto done;
+        }
+
+        dlist_free(&kin);
+        free(crcs);
+        free(qfirst);
+        free(qlast);
+        crcs = NULL;
+        qfirst = qlast = NULL;
+    }
+
+    /* nothing differs record by record, so the mismatch is elsewhere */
+    if (!ndiff) r = IMAP_AGAIN;
+
+done:
+    if (mailbox && !local->mailbox) mailbox_close(&mailbox);
+    dlist_free(&kl);
+    dlist_free(&kin);
+    free(tfirst);
+    free(tlast);
+    free(qfirst);
+    free(qlast);
+    free(crcs);
+    return r;
+}
+
 static int mailbox_full_update(struct sync_folder *local,
                                struct sync_reserve_list *reserve_list,
                                struct backend *sync_be,
@@ -4325,19 +4596,33 @@ static int mailbox_full_update(struct sync_folder *local,
     int remote_modseq_was_higher = 0;
     modseq_t xconvmodseq = 0;
     struct sync_msgid_list *part_list;
+    struct buf uidlist = BUF_INITIALIZER;
+    struct seqset *uids = NULL;
+
+    /* only fetch the records which differ, if we can tell which */
+    if (!find_changed_uids(local, sync_be, &uidlist))
+        uids = seqset_parse(buf_cstring(&uidlist), NULL, 0);
 
     if (flags & SYNC_FLAG_VERBOSE)
-        printf("%s %s\n", cmd, local->name);
+        printf("%s %s%s%s\n", cmd, local->name,
+               uids ? " " : "", uids ? buf_cstring(&uidlist) : "");
 
     if (flags & SYNC_FLAG_LOGGING)
-        syslog(LOG_INFO, "%s %s", cmd, local->name);
+        syslog(LOG_INFO, "%s %s%s%s", cmd, local->name,
+               uids ? " " : "", uids ? buf_cstring(&uidlist) : "");
 
-    kl = dlist_setatom(NULL, cmd, local->name);
+    if (uids) {
+        kl = dlist_newkvlist(NULL, cmd);
+        dlist_setatom(kl, "MBOXNAME", local->name);
+        dlist_setatom(kl, "UIDS", buf_cstring(&uidlist));
+    }
+    else kl = dlist_setatom(NULL, cmd, local->name);
     sync_send_lookup(kl, sync_be->out);
     dlist_free(&kl);
+    buf_free(&uidlist);
 
     r = sync_parse_response(cmd, sync_be->in, &kin);
-    if (r) return r;
+    if (r) goto done;
 
     kl = kin->head;
 
@@ -4408,7 +4693,7 @@ static int mailbox_full_update(struct sync_folder *local,
     }
 
     r = mailbox_update_loop(mailbox, kr->head, last_uid,
-                            highestmodseq, NULL, part_list, sync_be);
+                            highestmodseq, NULL, part_list, sync_be, uids);
     if (r) {
         syslog(LOG_ERR, "SYNCNOTICE: failed to prepare update for %s: %s",
                mailbox->name, error_message(r));
@@ -4426,7 +4711,7 @@ static int mailbox_full_update(struct sync_folder *local,
 
     kaction = dlist_newlist(NULL, "ACTION");
     r = mailbox_update_loop(mailbox, kr->head, last_uid,
-                            highestmodseq, kaction, part_list, sync_be);
+                            highestmodseq, kaction, part_list, sync_be, uids);
     if (r) goto cleanup;
 
     /* if replica still has a higher last_uid, bump our local
@@ -4491,6 +4776,7 @@ done:
 
     if (mailbox && !local->mailbox) mailbox_close(&mailbox);
 
+    seqset_free(uids);
     dlist_free(&kin);
     dlist_free(&kaction);
     dlist_free(&kexpunge);
@@ -4622,7 +4908,7 @@ static int update_mailbox_once(struct sync_folder *local,
 
     if (!topart) topart = mailbox->part;
     part_list = sync_reserve_partlist(reserve_list, topart);
-    r = sync_prepare_dlists(mailbox, remote, topart, part_list, kl, kupload, 1);
+    r = sync_prepare_dlists(mailbox, remote, topart, part_list, kl, kupload, 1, NULL);
     if (r) goto done;
 
     /* keep the mailbox locked for shorter time! Unlock the index now
@@ -5481,6 +5767,8 @@ EXPORTED const char *sync_get(struct dlist *kin, struct sync_state *state)
 
     if (!strcmp(kin->name, "ANNOTATION"))
         r = sync_get_annotation(kin, state);
+    else if (!strcmp(kin->name, "CRCRANGES"))
+        r = sync_get_crcranges(kin, state);
     else if (!strcmp(kin->name, "FETCH"))
         r = sync_get_message(kin, state);
     else if (!strcmp(kin->name, "FETCH_SIEVE"))
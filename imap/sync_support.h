@@ -48,6 +48,7 @@
 
 #include "backend.h"
 #include "dlist.h"
+#include "hash.h"
 #include "prot.h"
 #include "seen.h"
 #include "mailbox.h"
@@ -91,6 +92,7 @@ struct sync_msgid {
     char *fname;
     unsigned int need_upload:1;
     unsigned int is_archive:1;
+    unsigned int is_verified:1;     /* fname is known to hash to guid */
 };
 
 struct sync_msgid_list {
@@ -383,6 +385,7 @@ struct sync_action {
 struct sync_action_list {
     struct sync_action *head, *tail;
     unsigned long count;
+    hash_table index;   /* "name\tuser" -> struct sync_action */
 };
 
 struct sync_action_list *sync_action_list_create(void);
@@ -449,6 +452,7 @@ int sync_get_sieve(struct dlist *kin, struct sync_state *sstate);
 int sync_get_annotation(struct dlist *kin, struct sync_state *sstate);
 int sync_get_quota(struct dlist *kin, struct sync_state *sstate);
 int sync_get_fullmailbox(struct dlist *kin, struct sync_state *sstate);
+int sync_get_crcranges(struct dlist *kin, struct sync_state *sstate);
 int sync_get_mailboxes(struct dlist *kin, struct sync_state *sstate);
 int sync_get_meta(struct dlist *kin, struct sync_state *sstate);
 int sync_get_user(struct dlist *kin, struct sync_state *sstate);
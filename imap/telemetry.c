@@ -55,6 +55,7 @@
 
 #include "prot.h"
 #include "global.h"
+#include "xstats.h"
 
 /* create telemetry log; return fd of log */
 EXPORTED int telemetry_log(const char *userid, struct protstream *pin,
@@ -133,6 +134,9 @@ EXPORTED void telemetry_rusage(char *userid)
                (unsigned long)user.tv_sec, (int)user.tv_usec,
                (unsigned long)sys.tv_sec, (int)sys.tv_usec);
 
+        if (config_getswitch(IMAPOPT_TIMERLOG))
+            xstats_timer_log(userid);
+
         previous = current;
     }
 
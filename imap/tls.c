@@ -936,7 +936,8 @@ EXPORTED int     tls_init_serverengine(const char *ident,
             fname = tofree;
         }
 
-        r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &sessdb);
+        r = cyrusdb_open(DB, fname, CYRUSDB_CREATE | CYRUSDB_LAZYCOMMIT,
+                         &sessdb);
         if (r != 0) {
             syslog(LOG_ERR, "DBERROR: opening %s: %s",
                    fname, cyrusdb_strerror(ret));
@@ -1334,7 +1335,7 @@ EXPORTED int tls_prune_sessions(void)
         fname = tofree;
     }
 
-    ret = cyrusdb_open(DB, fname, 0, &sessdb);
+    ret = cyrusdb_open(DB, fname, CYRUSDB_LAZYCOMMIT, &sessdb);
     if (ret != CYRUSDB_OK) {
         syslog(LOG_ERR, "DBERROR: opening %s: %s",
                fname, cyrusdb_strerror(ret));
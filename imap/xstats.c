@@ -41,6 +41,12 @@
  */
 
 #include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include "util.h"
+#include "xmalloc.h"
+#include "xstrlcpy.h"
 #include "xstats.h"
 
 
@@ -50,3 +56,125 @@ EXPORTED const char *xstats_names[XSTATS_NUM_METRICS] = {
 #include "xstats_metrics.h"
 #undef X
 };
+
+EXPORTED struct xstats_timer xstats_timers[XSTATS_NUM_TIMERS];
+EXPORTED const char *xstats_timer_names[XSTATS_NUM_TIMERS] = {
+#define X(x) _STRINGIFY(x)
+#include "xstats_timers.h"
+#undef X
+};
+
+struct xstats_namedtimer {
+    char name[64];
+    struct xstats_timer t;
+};
+
+static struct xstats_namedtimer *namedtimers;
+static int nnamedtimers;
+
+static void timer_record(struct xstats_timer *t, const struct timeval *start)
+{
+    struct timeval now;
+    int64_t usec;
+    unsigned bucket = 0;
+
+    gettimeofday(&now, NULL);
+    usec = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+           (now.tv_usec - start->tv_usec);
+    if (usec < 0) usec = 0;     /* clock stepped backwards */
+    if (usec > UINT32_MAX) usec = UINT32_MAX;
+
+    while (usec >> bucket && bucket < XSTATS_TIMER_BUCKETS - 1)
+        bucket++;
+
+    t->count++;
+    t->total += usec;
+    if ((uint32_t)usec > t->max) t->max = usec;
+    t->buckets[bucket]++;
+}
+
+EXPORTED void xstats_timer_add(int timer, const struct timeval *start)
+{
+    timer_record(&xstats_timers[timer], start);
+}
+
+EXPORTED void xstats_namedtimer_add(const char *group, const char *name,
+                                    const struct timeval *start)
+{
+    char key[64];
+    int i;
+
+    snprintf(key, sizeof(key), "%s.%s", group, name);
+    lcase(key);
+
+    for (i = 0 ; i < nnamedtimers ; i++) {
+        if (!strcmp(namedtimers[i].name, key))
+            goto found;
+    }
+
+    if (!namedtimers)
+        namedtimers = xzmalloc((XSTATS_MAX_NAMEDTIMERS + 1) *
+                               sizeof(struct xstats_namedtimer));
+
+    if (nnamedtimers == XSTATS_MAX_NAMEDTIMERS) {
+        /* the table is full, use the overflow slot */
+        i = XSTATS_MAX_NAMEDTIMERS;
+        strlcpy(namedtimers[i].name, "other", sizeof(namedtimers[i].name));
+        goto found;
+    }
+
+    i = nnamedtimers++;
+    strlcpy(namedtimers[i].name, key, sizeof(namedtimers[i].name));
+
+found:
+    timer_record(&namedtimers[i].t, start);
+}
+
+/*
+ * Call 'cb' for every fixed timer, and every named timer which has
+ * been used.
+ */
+EXPORTED void xstats_timer_foreach(xstats_timer_cb *cb, void *rock)
+{
+    int i;
+
+    for (i = 0 ; i < XSTATS_NUM_TIMERS ; i++)
+        cb(xstats_timer_names[i], &xstats_timers[i], rock);
+
+    for (i = 0 ; i < nnamedtimers ; i++)
+        cb(namedtimers[i].name, &namedtimers[i].t, rock);
+
+    if (namedtimers && namedtimers[XSTATS_MAX_NAMEDTIMERS].t.count)
+        cb(namedtimers[XSTATS_MAX_NAMEDTIMERS].name,
+           &namedtimers[XSTATS_MAX_NAMEDTIMERS].t, rock);
+}
+
+static void timer_log(const char *name, struct xstats_timer *t, void *rock)
+{
+    const char *userid = (const char *) rock;
+    struct buf buf = BUF_INITIALIZER;
+    int i;
+
+    if (!t->count) return;
+
+    for (i = 0 ; i < XSTATS_TIMER_BUCKETS ; i++)
+        buf_printf(&buf, "%s%u", i ? " " : "", t->buckets[i]);
+
+    syslog(LOG_NOTICE, "TIMER %s %s count: %u total: %llu max: %u "
+           "buckets: %s", userid, name,
+           t->count, (unsigned long long)t->total, t->max,
+           buf_cstring(&buf));
+
+    buf_free(&buf);
+
+    memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Log the histograms collected since the last call, so that they
+ * can be aggregated across processes from the logs.
+ */
+EXPORTED void xstats_timer_log(const char *userid)
+{
+    xstats_timer_foreach(timer_log, (void *) userid);
+}
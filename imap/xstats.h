@@ -49,6 +49,7 @@
 # include <stdint.h>
 #endif
 #include <config.h>
+#include <sys/time.h>
 
 #define _PASTE(a,b)             a##b
 #define _STRINGIFY(x)           #x
@@ -68,4 +69,48 @@ extern const char *xstats_names[XSTATS_NUM_METRICS];
 
 /*-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-*/
 
+/* Latency histograms.  Bucket 0 counts samples under 1 microsecond,
+ * bucket N samples in [2^(N-1), 2^N) microseconds, and the last
+ * bucket everything slower than that. */
+#define XSTATS_TIMER_BUCKETS    24
+
+enum
+{
+#define X(x)    _PASTE(XSTATS_TIMER_,x)
+#include "xstats_timers.h"
+#undef X
+    XSTATS_NUM_TIMERS
+};
+
+struct xstats_timer {
+    uint32_t count;
+    uint32_t max;                       /* microseconds */
+    uint64_t total;                     /* microseconds */
+    uint32_t buckets[XSTATS_TIMER_BUCKETS];
+};
+extern struct xstats_timer xstats_timers[XSTATS_NUM_TIMERS];
+extern const char *xstats_timer_names[XSTATS_NUM_TIMERS];
+
+extern void xstats_timer_add(int timer, const struct timeval *start);
+
+/* Timers named at runtime, such as one per protocol command, reported
+ * as "group.name".  Names past XSTATS_MAX_NAMEDTIMERS share the timer
+ * "other", so clients can't grow the table without bound. */
+#define XSTATS_MAX_NAMEDTIMERS  128
+extern void xstats_namedtimer_add(const char *group, const char *name,
+                                  const struct timeval *start);
+
+typedef void xstats_timer_cb(const char *name, struct xstats_timer *t,
+                             void *rock);
+extern void xstats_timer_foreach(xstats_timer_cb *cb, void *rock);
+extern void xstats_timer_log(const char *userid);
+
+#define xstats_timer_start(tv)  gettimeofday((tv), NULL)
+#define xstats_timer_stop(m, tv) \
+                                xstats_timer_add(_PASTE(XSTATS_TIMER_,m), (tv))
+#define xstats_namedtimer_stop(g, n, tv) \
+                                xstats_namedtimer_add((g), (n), (tv))
+
+/*-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-*/
+
 #endif /* __CYRUS_IMAP_XSTATS_H__ */
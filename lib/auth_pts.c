@@ -361,7 +361,8 @@ static int ptload(const char *identifier, struct auth_state **state)
         tofree = strconcat(config_dir, PTS_DBFIL, (char *)NULL);
         fname = tofree;
     }
-    r = cyrusdb_open(the_ptscache_db, fname, CYRUSDB_CREATE, &ptdb);
+    r = cyrusdb_open(the_ptscache_db, fname,
+                     CYRUSDB_CREATE | CYRUSDB_LAZYCOMMIT, &ptdb);
     if (r != 0) {
         syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
                cyrusdb_strerror(ret));
@@ -111,17 +111,16 @@ struct canon_state {
 };
 
 struct comp_pat_s {
-    int max_start;
     size_t patlen;
+    size_t next[1];     /* KMP failure function, patlen entries */
 };
 
 struct search_state {
-    ssize_t *starts;
-    int max_start;
+    const size_t *next;
     int havematch;
     unsigned char *substr;
     size_t patlen;
-    size_t offset;
+    size_t matched;
 };
 
 enum html_state {
@@ -764,48 +763,26 @@ static void uni2utf8(struct convert_rock *rock, int c)
 static void byte2search(struct convert_rock *rock, int c)
 {
     struct search_state *s = (struct search_state *)rock->state;
-    int i, cur;
     unsigned char b = (unsigned char)c;
 
     if (c == U_REPLACEMENT) {
         c = 0xff; /* searchable by invalid character! */
     }
 
-    /* check our "in_progress" matches to see if they're still valid */
-    for (i = 0, cur = 0; i < s->max_start; i++) {
-        /* no more active offsets */
-        if (s->starts[i] == -1)
-            break;
+    /* nothing more to learn once we've matched */
+    if (s->havematch)
+        return;
 
-        /* if we've passed one that's not ongoing, copy back */
-        if (cur < i)
-            s->starts[cur] = s->starts[i];
+    /* fall back along the failure function until this byte extends
+     * a partial match, or we're back at the start of the pattern */
+    while (s->matched && b != s->substr[s->matched])
+        s->matched = s->next[s->matched - 1];
 
-        /* check that the substring is still maching */
-        if (b == s->substr[s->offset - s->starts[i]]) {
-            if (s->offset - s->starts[i] == s->patlen - 1) {
-                /* we're there! */
-                s->havematch = 1;
-            }
-            else {
-                /* keep this one, it's ongoing */
-                cur++;
-            }
-        }
-    }
-    /* starting a new one! */
-    if (b == s->substr[0]) {
-        /* have to treat this one specially! */
-        if (s->patlen == 1)
-            s->havematch = 1;
-        else
-            s->starts[cur++] = s->offset;
-    }
-    /* empty out any others that aren't being kept */
-    while (cur < i) s->starts[cur++] = -1;
+    if (b == s->substr[s->matched])
+        s->matched++;
 
-    /* increment the offset counter */
-    s->offset++;
+    if (s->matched == s->patlen)
+        s->havematch = 1;
 }
 
 /* Given an octet, append it to a buffer */
@@ -1446,15 +1423,6 @@ static void basic_free(struct convert_rock *rock)
     }
 }
 
-static void search_free(struct convert_rock *rock)
-{
-    if (rock && rock->state) {
-        struct search_state *s = (struct search_state *)rock->state;
-        if (s->starts) free(s->starts);
-    }
-    basic_free(rock);
-}
-
 static void buffer_free(struct convert_rock *rock)
 {
     if (rock && rock->state) {
@@ -1551,22 +1519,17 @@ static struct convert_rock *search_init(const char *substr, comp_pat *pat) {
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     struct search_state *s = xzmalloc(sizeof(struct search_state));
     struct comp_pat_s *p = (struct comp_pat_s *)pat;
-    int i;
 
     /* copy in tracking vars */
-    s->max_start = p->max_start;
+    s->next = p->next;
     s->patlen = p->patlen;
     s->substr = (unsigned char *)substr;
-
-    /* allocate tracking space and initialise to "no match" */
-    s->starts = xmalloc(s->max_start * sizeof(size_t));
-    for (i = 0; i < s->max_start; i++) {
-        s->starts[i] = -1;
-    }
+    /* an empty pattern matches anything, without looking at a byte */
+    s->havematch = !s->patlen;
 
     /* set up the rock */
     rock->f = byte2search;
-    rock->cleanup = search_free;
+    rock->cleanup = basic_free;
     rock->state = (void *)s;
 
     return rock;
@@ -1889,22 +1852,32 @@ EXPORTED int charset_search_mimeheader(const char *substr, comp_pat *pat,
     return res;
 }
 
-/* Compile a search pattern for later comparison.  We just count
- * how long the string is, and how many times the first character
- * occurs.  Later optimisation could reduce the max_start by
- * deeper analysis of the possible paths through the string, but
- * this is a good absolute maximum, and it just means a few more
- * bytes get allocated... */
+/* Compile a search pattern for later comparison.  We precompute
+ * the Knuth-Morris-Pratt failure function for the string, so that
+ * the search only ever has to track a single partial match and
+ * each byte of the canonicalised input costs amortised O(1),
+ * rather than a walk over every potential match start. */
 EXPORTED comp_pat *charset_compilepat(const char *s)
 {
-    struct comp_pat_s *pat = xzmalloc(sizeof(struct comp_pat_s));
-    const char *p = s;
-    /* count occurances */
-    while (*p) {
-        if (*p == *s) pat->max_start++;
-        pat->patlen++;
-        p++;
+    const unsigned char *p = (const unsigned char *)s;
+    size_t patlen = strlen(s);
+    struct comp_pat_s *pat;
+    size_t i, k;
+
+    pat = xzmalloc(sizeof(struct comp_pat_s) +
+                   (patlen ? patlen - 1 : 0) * sizeof(size_t));
+    pat->patlen = patlen;
+
+    /* next[i] is the length of the longest proper prefix of
+     * p[0..i] which is also a suffix of it */
+    for (i = 1, k = 0; i < patlen; i++) {
+        while (k && p[i] != p[k])
+            k = pat->next[k - 1];
+        if (p[i] == p[k])
+            k++;
+        pat->next[i] = k;
     }
+
     return (comp_pat *)pat;
 }
 
@@ -50,6 +50,7 @@
 #include <syslog.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -85,6 +86,24 @@ struct db {
     struct cyrusdb_backend *backend;
 };
 
+static cyrusdb_timer_cb *timer_cb = NULL;
+
+EXPORTED void cyrusdb_settimer(cyrusdb_timer_cb *cb)
+{
+    timer_cb = cb;
+}
+
+static inline void timer_start(struct timeval *start)
+{
+    if (timer_cb) gettimeofday(start, NULL);
+}
+
+static inline void timer_stop(enum cyrusdb_timer_op op,
+                              const struct timeval *start)
+{
+    if (timer_cb) timer_cb(op, start);
+}
+
 static struct cyrusdb_backend *cyrusdb_fromname(const char *name)
 {
     int i;
@@ -110,8 +129,11 @@ static int _open(const char *backend, const char *fname,
 {
     const char *realname;
     struct db *db = xzmalloc(sizeof(struct db));
+    struct timeval start;
     int r;
 
+    timer_start(&start);
+
     if (!backend) backend = DEFAULT_BACKEND; /* not used yet, later */
     db->backend = cyrusdb_fromname(backend);
 
@@ -167,6 +189,8 @@ done:
     if (r) free(db);
     else *ret = db;
 
+    timer_stop(CYRUSDB_TIMER_OPEN, &start);
+
     return r;
 }
 
@@ -196,8 +220,15 @@ EXPORTED int cyrusdb_fetch(struct db *db,
              const char **data, size_t *datalen,
              struct txn **mytid)
 {
-    return db->backend->fetch(db->engine, key, keylen,
-                              data, datalen, mytid);
+    struct timeval start;
+    int r;
+
+    timer_start(&start);
+    r = db->backend->fetch(db->engine, key, keylen,
+                           data, datalen, mytid);
+    timer_stop(CYRUSDB_TIMER_FETCH, &start);
+
+    return r;
 }
 
 EXPORTED int cyrusdb_fetchlock(struct db *db,
@@ -205,8 +236,15 @@ EXPORTED int cyrusdb_fetchlock(struct db *db,
                  const char **data, size_t *datalen,
                  struct txn **mytid)
 {
-    return db->backend->fetchlock(db->engine, key, keylen,
-                                  data, datalen, mytid);
+    struct timeval start;
+    int r;
+
+    timer_start(&start);
+    r = db->backend->fetchlock(db->engine, key, keylen,
+                               data, datalen, mytid);
+    timer_stop(CYRUSDB_TIMER_FETCHLOCK, &start);
+
+    return r;
 }
 
 EXPORTED int cyrusdb_fetchnext(struct db *db,
@@ -215,9 +253,16 @@ EXPORTED int cyrusdb_fetchnext(struct db *db,
                  const char **data, size_t *datalen,
                  struct txn **mytid)
 {
-    return db->backend->fetchnext(db->engine, key, keylen,
-                                  found, foundlen,
-                                  data, datalen, mytid);
+    struct timeval start;
+    int r;
+
+    timer_start(&start);
+    r = db->backend->fetchnext(db->engine, key, keylen,
+                               found, foundlen,
+                               data, datalen, mytid);
+    timer_stop(CYRUSDB_TIMER_FETCHNEXT, &start);
+
+    return r;
 }
 
 EXPORTED int cyrusdb_foreach(struct db *db,
@@ -252,7 +297,14 @@ EXPORTED int cyrusdb_create(struct db *db,
               const char *data, size_t datalen,
               struct txn **tid)
 {
-    return db->backend->create(db->engine, key, keylen, data, datalen, tid);
+    struct timeval start;
+    int r;
+
+    timer_start(&start);
+    r = db->backend->create(db->engine, key, keylen, data, datalen, tid);
+    timer_stop(CYRUSDB_TIMER_CREATE, &start);
+
+    return r;
 }
 
 EXPORTED int cyrusdb_store(struct db *db,
@@ -260,19 +312,40 @@ EXPORTED int cyrusdb_store(struct db *db,
              const char *data, size_t datalen,
              struct txn **tid)
 {
-    return db->backend->store(db->engine, key, keylen, data, datalen, tid);
+    struct timeval start;
+    int r;
+
+    timer_start(&start);
+    r = db->backend->store(db->engine, key, keylen, data, datalen, tid);
+    timer_stop(CYRUSDB_TIMER_STORE, &start);
+
+    return r;
 }
 
 EXPORTED int cyrusdb_delete(struct db *db,
               const char *key, size_t keylen,
               struct txn **tid, int force)
 {
-    return db->backend->delete(db->engine, key, keylen, tid, force);
+    struct timeval start;
+    int r;
+
+    timer_start(&start);
+    r = db->backend->delete(db->engine, key, keylen, tid, force);
+    timer_stop(CYRUSDB_TIMER_DELETE, &start);
+
+    return r;
 }
 
 EXPORTED int cyrusdb_commit(struct db *db, struct txn *tid)
 {
-    return db->backend->commit(db->engine, tid);
+    struct timeval start;
+    int r;
+
+    timer_start(&start);
+    r = db->backend->commit(db->engine, tid);
+    timer_stop(CYRUSDB_TIMER_COMMIT, &start);
+
+    return r;
 }
 
 EXPORTED int cyrusdb_abort(struct db *db, struct txn *tid)
@@ -43,6 +43,7 @@
 #define INCLUDED_CYRUSDB_H
 
 #include <stdio.h>
+#include <sys/time.h>
 #include "strarray.h"
 
 struct db;
@@ -72,7 +73,9 @@ enum cyrusdb_dbflags {
 enum cyrusdb_openflags {
     CYRUSDB_CREATE   = 0x01,    /* Create the database if not existant */
     CYRUSDB_MBOXSORT = 0x02,    /* Use mailbox sort order ('.' sorts 1st) */
-    CYRUSDB_CONVERT  = 0x04     /* Convert to the named format if not already */
+    CYRUSDB_CONVERT  = 0x04,    /* Convert to the named format if not already */
+    CYRUSDB_LAZYCOMMIT = 0x08   /* Cache which can be rebuilt: the most recent
+                                   commit may be lost in a crash */
 };
 
 typedef int foreach_p(void *rock,
@@ -284,6 +287,22 @@ extern int cyrusdb_compar(struct db *db,
                           const char *a, int alen,
                           const char *b, int blen);
 
+/* optional latency callback, invoked with the operation and its start
+ * time */
+enum cyrusdb_timer_op {
+    CYRUSDB_TIMER_OPEN = 0,
+    CYRUSDB_TIMER_FETCH,
+    CYRUSDB_TIMER_FETCHLOCK,
+    CYRUSDB_TIMER_FETCHNEXT,
+    CYRUSDB_TIMER_CREATE,
+    CYRUSDB_TIMER_STORE,
+    CYRUSDB_TIMER_DELETE,
+    CYRUSDB_TIMER_COMMIT
+};
+typedef void cyrusdb_timer_cb(enum cyrusdb_timer_op op,
+                              const struct timeval *start);
+extern void cyrusdb_settimer(cyrusdb_timer_cb *cb);
+
 /* somewhat special case, because they don't take a DB */
 
 extern int cyrusdb_sync(const char *backend);
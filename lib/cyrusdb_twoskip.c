@@ -188,6 +188,9 @@
  * 2) after all changes, fdatasync is run again.
  * 3) finally, the header is updated with a new current_size and
  *    the DIRTY flag clear, then fdatasync is run for a third time.
+ *    With twoskip_lazy_commit, databases opened CYRUSDB_LAZYCOMMIT
+ *    leave this last sync to step 1 of the next transaction, or to
+ *    closing the database, whichever comes first.
  *
  * ADDING A NEW RECORD:
  * a new record is created with forward locations pointing to the
@@ -275,6 +278,13 @@
  * limited to 255 by file format, but skiplist had 20, and that was enough
  * for most real uses.  31 is heaps. */
 #define MAXLEVEL 31
+/* number of records a foreach without a transaction visits under one
+ * read lock before it drops the lock so that writers can get in, and
+ * how long (in microseconds) it then waits before taking it again.
+ * fcntl locks aren't fair, so without the wait a writer blocked on the
+ * lock would almost never win it back from the scan. */
+#define FOREACH_YIELD 16384
+#define FOREACH_YIELD_USEC 100
 /* should be 0.5 for binary search semantics */
 #define PROB 0.5
 
@@ -1515,6 +1525,7 @@ static int myforeach(struct dbengine *db,
 {
     int r = 0, cb_r = 0;
     int need_unlock = 0;
+    unsigned nvisited = 0;
     const char *val;
     size_t vallen;
     struct buf keybuf = BUF_INITIALIZER;
@@ -1552,6 +1563,32 @@ static int myforeach(struct dbengine *db,
     }
 
     while (db->loc.is_exactmatch) {
+        if (!tidptr && ++nvisited % FOREACH_YIELD == 0) {
+            /* don't hold the lock for the whole of a long scan,
+             * just pick up again at the same key */
+            buf_copy(&keybuf, &db->loc.keybuf);
+
+            r = unlock(db);
+            if (r) goto done;
+            need_unlock = 0;
+
+            usleep(FOREACH_YIELD_USEC);
+
+            r = read_lock(db);
+            if (r) goto done;
+            need_unlock = 1;
+
+            r = find_loc(db, keybuf.s, keybuf.len);
+            if (r) goto done;
+
+            if (!db->loc.is_exactmatch) {
+                /* it was deleted meanwhile, move on to the next one */
+                r = advance_loc(db);
+                if (r) goto done;
+                continue;
+            }
+        }
+
         /* does it match prefix? */
         if (prefixlen) {
             if (db->loc.record.keylen < prefixlen) break;
@@ -1584,6 +1621,7 @@ static int myforeach(struct dbengine *db,
                 r = read_lock(db);
                 if (r) goto done;
                 need_unlock = 1;
+                nvisited = 0;
             }
 
             /* should be cheap if we're already here */
@@ -1669,7 +1707,16 @@ static int mycommit(struct dbengine *db, struct txn *tid)
     /* finally, update the header and commit again */
     db->header.current_size = db->end;
     db->header.flags &= ~DIRTY;
-    r = commit_header(db);
+    if ((db->open_flags & CYRUSDB_LAZYCOMMIT) &&
+        libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_LAZY_COMMIT)) {
+        /* the records are already on disk, so the old header is
+         * still safe to recover from.  The sync of the DIRTY header
+         * at the start of the next transaction writes this one out */
+        r = write_header(db);
+        if (!r) mappedfile_defer_commit(db->mf);
+    }
+    else
+        r = commit_header(db);
 
  done:
     if (r) {
@@ -1822,6 +1869,11 @@ static int mycheckpoint(struct dbengine *db)
     r = mycommit(cr.db, cr.tid);
     if (r) goto err;
 
+    /* a lazy commit may have left the header unsynced; it must be
+     * on disk before the new file replaces the old one */
+    r = mappedfile_commit(cr.db->mf);
+    if (r) goto err;
+
     /* move new file to original file name */
     r = mappedfile_rename(cr.db->mf, FNAME(db));
     if (r) goto err;
@@ -2102,6 +2154,9 @@ static int recovery2(struct dbengine *db, int *count)
     /* regardless, we had a commit during create, and in any _copy_commit, so
      * rename into place */
 
+    r = mappedfile_commit(newdb->mf);
+    if (r) goto err;
+
     /* move new file to original file name */
     r = mappedfile_rename(newdb->mf, FNAME(db));
     if (r) goto err;
@@ -144,6 +144,14 @@ static struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 1),
       CYRUS_OPT_SWITCH },
 
+    { CYRUSOPT_TWOSKIP_LAZY_COMMIT,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_COMPRESS_LEVEL,
+      CFGVAL(long, 6),
+      CYRUS_OPT_INT },
+
     { CYRUSOPT_LAST, { NULL }, CYRUS_OPT_NOTOPT }
 };
 
@@ -105,6 +105,10 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* Don't sync the twoskip header at the end of each commit (OFF) */
+    CYRUSOPT_TWOSKIP_LAZY_COMMIT,
+    /* zlib compression level for compressed connections (6) */
+    CYRUSOPT_COMPRESS_LEVEL,
 
     CYRUSOPT_LAST
 
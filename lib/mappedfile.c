@@ -96,6 +96,7 @@ struct mappedfile {
     /* tracking */
     int lock_status;
     int dirty;
+    int deferred;
     int was_resized;
     int is_rw;
 };
@@ -187,6 +188,9 @@ EXPORTED int mappedfile_close(struct mappedfile **mfp)
     assert(mf->lock_status == MF_UNLOCKED);
     assert(!mf->dirty);
 
+    if (mf->deferred && fdatasync(mf->fd) < 0)
+        syslog(LOG_ERR, "IOERROR: %s fdatasync: %m", mf->fname);
+
     if (mf->fd >= 0)
         r = close(mf->fd);
 
@@ -304,7 +308,7 @@ EXPORTED int mappedfile_commit(struct mappedfile *mf)
 {
     assert(mf->fd != -1);
 
-    if (!mf->dirty)
+    if (!mf->dirty && !mf->deferred)
         return 0; /* nice, nothing to do */
 
     assert(mf->is_rw);
@@ -323,11 +327,25 @@ EXPORTED int mappedfile_commit(struct mappedfile *mf)
     }
 
     mf->dirty = 0;
+    mf->deferred = 0;
     mf->was_resized = 0;
 
     return 0;
 }
 
+/*
+ * Treat outstanding writes as committed without syncing them.  They
+ * reach the disk with the next mappedfile_commit() of this file by any
+ * process, at the latest when this process closes the file.
+ */
+EXPORTED void mappedfile_defer_commit(struct mappedfile *mf)
+{
+    assert(mf->fd != -1);
+
+    if (mf->dirty) mf->deferred = 1;
+    mf->dirty = 0;
+}
+
 EXPORTED ssize_t mappedfile_pwrite(struct mappedfile *mf,
                                    const char *base, size_t len,
                                    off_t offset)
@@ -62,6 +62,7 @@ extern int mappedfile_writelock(struct mappedfile *mf);
 extern int mappedfile_unlock(struct mappedfile *mf);
 
 extern int mappedfile_commit(struct mappedfile *mf);
+extern void mappedfile_defer_commit(struct mappedfile *mf);
 extern ssize_t mappedfile_pwrite(struct mappedfile *mf,
                                  const char *base, size_t len,
                                  off_t offset);
@@ -56,6 +56,10 @@
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#include <sys/uio.h>
 
 #include "assert.h"
 #include "exitcodes.h"
@@ -68,12 +72,43 @@
 #include "util.h"
 #include "xmalloc.h"
 
+#ifdef HAVE_SYS_EPOLL_H
+/* Per-fd state of a protgroup's epoll set, indexed by fd */
+struct prot_epoll_slot {
+    unsigned long want;     /* generation this fd was last wanted in */
+    unsigned long ready;    /* generation this fd last became readable in */
+    unsigned serial;        /* serial of the stream registered for this fd */
+    int registered;
+};
+
+/*
+ * The epoll set backing a protgroup.  Membership is reconciled lazily
+ * by prot_select(), so callers which reset and refill their protgroup
+ * before every select (like mupdate) cost no epoll_ctl() calls unless
+ * the set of streams actually changed.
+ */
+struct prot_epoll {
+    int fd;
+    unsigned long gen;
+    struct prot_epoll_slot *slots;
+    size_t nslots;
+    int *registered;        /* fds currently in the epoll set */
+    size_t nregistered;
+    size_t nallocreg;
+    struct epoll_event *events;
+    size_t nevents;
+};
+#endif
+
 /* Transparant protgroup structure */
 struct protgroup
 {
     size_t nalloced; /* Number of nodes in the group */
     size_t next_element; /* Node number of next group member */
     struct protstream **group;
+#ifdef HAVE_SYS_EPOLL_H
+    struct prot_epoll *epoll;
+#endif
 };
 
 /*
@@ -82,6 +117,7 @@ struct protgroup
  */
 EXPORTED struct protstream *prot_new(int fd, int write)
 {
+    static unsigned serial = 0;
     struct protstream *newstream;
 
     newstream = (struct protstream *) xzmalloc(sizeof(struct protstream));
@@ -94,6 +130,9 @@ EXPORTED struct protstream *prot_new(int fd, int write)
     newstream->write = write;
     newstream->logfd = PROT_NO_FD;
     newstream->big_buffer = PROT_NO_FD;
+    /* never zero, which stands for an extra fd with no stream */
+    if (!++serial) ++serial;
+    newstream->serial = serial;
     if(write)
         newstream->cnt = PROT_BUFSIZE;
 
@@ -349,6 +388,16 @@ static void zfree(voidpf opaque __attribute__((unused)),
     free(address);
 }
 
+/* The configured compression level for compressible data */
+static int prot_zlevel(void)
+{
+    int zlevel = libcyrus_config_getint(CYRUSOPT_COMPRESS_LEVEL);
+
+    if (zlevel < Z_BEST_SPEED) return Z_BEST_SPEED;
+    if (zlevel > Z_BEST_COMPRESSION) return Z_BEST_COMPRESSION;
+    return zlevel;
+}
+
 /*
  * Turn on (de)compression for this connection
  * If its an output stream, initialize a compressor,
@@ -371,7 +420,7 @@ EXPORTED int prot_setcompress(struct protstream *s)
                 goto error;
         }
 
-        s->zlevel = Z_DEFAULT_COMPRESSION;
+        s->zlevel = prot_zlevel();
         zr = deflateInit2(zstrm, s->zlevel, Z_DEFLATED,
                           -MAX_WBITS,           /* raw deflate */
                           MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
@@ -1189,6 +1238,85 @@ int prot_flush_internal(struct protstream *s, int force)
     return 0;
 }
 
+/*
+ * Can data written to 's' go straight to the file descriptor, or does
+ * it need to pass through our buffer to be logged, compressed,
+ * encrypted or spooled?
+ */
+static int prot_isplain(struct protstream *s)
+{
+    if (s->writetobuf || s->dontblock) return 0;
+    if (s->logfd != PROT_NO_FD || s->big_buffer != PROT_NO_FD) return 0;
+    if (s->saslssf) return 0;
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif
+#ifdef HAVE_SSL
+    if (s->tls_conn) return 0;
+#endif
+    return 1;
+}
+
+/*
+ * Write anything pending in the buffer of plain stream 's' followed by
+ * the 'len' bytes at 'buf', directly from the caller's memory with a
+ * single writev() where possible.  For a message mapped from the
+ * spool this saves copying every byte through our buffer.
+ */
+static int prot_write_direct(struct protstream *s, const char *buf,
+                             unsigned len)
+{
+    struct iovec iov[2];
+    int niov = 0;
+    ssize_t n;
+
+    if (s->dontblock_isset) {
+        nonblock(s->fd, 0);
+        s->dontblock_isset = 0;
+    }
+
+    if (s->ptr != s->buf) {
+        iov[niov].iov_base = s->buf;
+        iov[niov].iov_len = s->ptr - s->buf;
+        niov++;
+    }
+    iov[niov].iov_base = (char *)buf;
+    iov[niov].iov_len = len;
+    niov++;
+
+    while (niov) {
+        do {
+            cmdtime_netstart();
+            n = writev(s->fd, iov, niov);
+            cmdtime_netend();
+        } while (n == -1 && errno == EINTR && !signals_poll());
+
+        if (n == -1) {
+            s->error = xstrdup(strerror(errno));
+            break;
+        }
+
+        /* step over whatever got written */
+        while (niov && (size_t)n >= iov[0].iov_len) {
+            n -= iov[0].iov_len;
+            iov[0] = iov[1];
+            niov--;
+        }
+        if (niov) {
+            iov[0].iov_base = (char *)iov[0].iov_base + n;
+            iov[0].iov_len -= n;
+        }
+    }
+
+    s->ptr = s->buf;
+    s->cnt = s->maxplain;
+
+    if (s->error) return EOF;
+
+    s->bytes_out += len;
+    return 0;
+}
+
 /*
  * Write to the output stream 's' the 'len' bytes of data at 'buf'
  */
@@ -1203,7 +1331,7 @@ EXPORTED int prot_write(struct protstream *s, const char *buf, unsigned len)
 #ifdef HAVE_ZLIB
         if (s->zstrm) {
             int zr = Z_OK;
-            int zlevel = Z_DEFAULT_COMPRESSION;
+            int zlevel = prot_zlevel();
 
             if (is_incompressible(buf, len))
                 zlevel = Z_NO_COMPRESSION;
@@ -1229,9 +1357,11 @@ EXPORTED int prot_write(struct protstream *s, const char *buf, unsigned len)
         s->boundary = 0;
     }
 
+    /* more than a buffer's worth and nothing to do to it on the way */
+    if (len >= s->buf_size && prot_isplain(s))
+        return prot_write_direct(s, buf, len);
+
     while (len >= s->cnt) {
-        /* XXX can we manage to write data from 'buf' without copying it
-           to s->ptr ? */
         memcpy(s->ptr, buf, s->cnt);
         s->ptr += s->cnt;
         buf += s->cnt;
@@ -1591,6 +1721,164 @@ EXPORTED int prot_readbuf(struct protstream *s, struct buf *buf, unsigned size)
     return size;
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+static void prot_epoll_free(struct prot_epoll *ep)
+{
+    if (!ep) return;
+    if (ep->fd != -1) close(ep->fd);
+    free(ep->slots);
+    free(ep->registered);
+    free(ep->events);
+    free(ep);
+}
+
+/*
+ * Mark 'fd' as wanted in this generation, adding it to the epoll set
+ * if it isn't already there for the stream with 'serial'.
+ *
+ * The kernel keys registrations by open file, not by fd number, and
+ * forgets them when the file is closed, so an fd number we registered
+ * for one stream may since have been closed and reused by another.
+ * The serial tells the two apart.  An extra fd has no stream to tell
+ * by (serial 0), so it is always re-registered.
+ */
+static int prot_epoll_want(struct prot_epoll *ep, int fd, unsigned serial)
+{
+    struct epoll_event ev;
+
+    if ((size_t)fd >= ep->nslots) {
+        size_t n = ep->nslots ? ep->nslots : 64;
+        while (n <= (size_t)fd) n *= 2;
+        ep->slots = xrealloc(ep->slots, n * sizeof(struct prot_epoll_slot));
+        memset(ep->slots + ep->nslots, 0,
+               (n - ep->nslots) * sizeof(struct prot_epoll_slot));
+        ep->nslots = n;
+    }
+
+    ep->slots[fd].want = ep->gen;
+    if (ep->slots[fd].registered && serial && ep->slots[fd].serial == serial)
+        return 0;
+
+    /* the serial travels with each event, so that events from a stale
+     * registration of a reused fd number can be recognised */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = ((uint64_t) serial << 32) | (uint32_t) fd;
+    if (epoll_ctl(ep->fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        if (errno != EEXIST ||
+            epoll_ctl(ep->fd, EPOLL_CTL_MOD, fd, &ev) == -1)
+            return -1;
+    }
+    ep->slots[fd].serial = serial;
+
+    if (ep->slots[fd].registered)
+        return 0;
+
+    if (ep->nregistered == ep->nallocreg) {
+        ep->nallocreg = ep->nallocreg ? ep->nallocreg * 2 : 16;
+        ep->registered = xrealloc(ep->registered, ep->nallocreg * sizeof(int));
+    }
+    ep->registered[ep->nregistered++] = fd;
+    ep->slots[fd].registered = 1;
+
+    return 0;
+}
+
+/*
+ * Wait for input on the streams of 'group' and on 'extra_fd' using the
+ * group's epoll set, which is created on first use and then kept in
+ * step with the group's membership.  Level-triggered, because callers
+ * don't necessarily drain a stream before selecting again.
+ *
+ * Returns -1 on error, otherwise the ready fds are marked in the
+ * current generation for prot_epoll_isready().
+ */
+static int prot_epoll_wait(struct protgroup *group, int extra_fd,
+                           struct timeval *timeout)
+{
+    struct prot_epoll *ep = group->epoll;
+    int timeout_ms = -1;
+    unsigned i;
+    int n;
+
+  again:
+    if (!ep) {
+        ep = xzmalloc(sizeof(struct prot_epoll));
+        ep->fd = epoll_create1(EPOLL_CLOEXEC);
+        if (ep->fd == -1) {
+            prot_epoll_free(ep);
+            return -1;
+        }
+        group->epoll = ep;
+    }
+
+    ep->gen++;
+
+    if (extra_fd != PROT_NO_FD && prot_epoll_want(ep, extra_fd, 0) == -1)
+        return -1;
+
+    for (i = 0; i < group->next_element; i++) {
+        struct protstream *s = group->group[i];
+        if (s && prot_epoll_want(ep, s->fd, s->serial) == -1)
+            return -1;
+    }
+
+    /* drop anything which has left the group since last time.  The fd
+     * may already have been closed, which removes it from the set */
+    for (i = 0; i < ep->nregistered; ) {
+        int fd = ep->registered[i];
+        if (ep->slots[fd].want == ep->gen) {
+            i++;
+            continue;
+        }
+        epoll_ctl(ep->fd, EPOLL_CTL_DEL, fd, NULL);
+        ep->slots[fd].registered = 0;
+        ep->registered[i] = ep->registered[--ep->nregistered];
+    }
+
+    if (ep->nevents < ep->nregistered || !ep->nevents) {
+        ep->nevents = ep->nregistered ? ep->nregistered : 1;
+        ep->events = xrealloc(ep->events,
+                              ep->nevents * sizeof(struct epoll_event));
+    }
+
+    if (timeout)
+        timeout_ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+
+    n = signals_epoll_wait(ep->fd, ep->events, ep->nevents, timeout_ms);
+    if (n == -1)
+        return -1;
+
+    while (n--) {
+        int fd = (int) (ep->events[n].data.u64 & 0xffffffff);
+        unsigned serial = (unsigned) (ep->events[n].data.u64 >> 32);
+
+        if ((size_t)fd < ep->nslots && ep->slots[fd].want == ep->gen &&
+            ep->slots[fd].serial == serial) {
+            ep->slots[fd].ready = ep->gen;
+        }
+        else {
+            /* a stale registration whose fd was closed (and perhaps
+             * reused) while its file is still open elsewhere: we can't
+             * name it to remove it, so start over with a fresh set */
+            prot_epoll_free(ep);
+            group->epoll = ep = NULL;
+            goto again;
+        }
+    }
+
+    return 0;
+}
+
+static int prot_epoll_isready(struct protgroup *group, int fd)
+{
+    struct prot_epoll *ep = group->epoll;
+
+    return (ep && (size_t)fd < ep->nslots &&
+            ep->slots[fd].ready == ep->gen);
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
 /*
  * select() for protection streams, read only
  * Also supports selecting on an extra file descriptor
@@ -1605,9 +1893,12 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
 {
     struct protstream *s, *timeout_prot = NULL;
     struct protgroup *retval = NULL;
-    int max_fd, found_fds = 0;
+    int found_fds = 0;
     unsigned i;
+#ifndef HAVE_SYS_EPOLL_H
+    int max_fd;
     fd_set rfds;
+#endif
     int have_readtimeout = 0;
     struct timeval my_timeout;
     struct prot_waitevent *event;
@@ -1621,11 +1912,6 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
     /* Initialize things we might use */
     errno = 0;
     found_fds = 0;
-    FD_ZERO(&rfds);
-
-    /* If extra_read_fd is PROT_NO_FD, then the first protstream
-     * will override it */
-    max_fd = extra_read_fd;
 
     for(i = 0; i<readstreams->next_element; i++) {
         int have_thistimeout = 0; /* used to compute the minimal timeout for */
@@ -1660,10 +1946,6 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
                 timeout_prot = s;
         }
 
-        FD_SET(s->fd, &rfds);
-        if(s->fd > max_fd)
-            max_fd = s->fd;
-
         /* Is something currently pending in our protstream's buffer? */
         if(s->cnt > 0) {
             found_fds++;
@@ -1691,12 +1973,6 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
     if(!retval) {
         time_t sleepfor;
 
-        /* do a select */
-        if(extra_read_fd != PROT_NO_FD) {
-            /* max_fd started with atleast extra_read_fd */
-            FD_SET(extra_read_fd, &rfds);
-        }
-
         if(read_timeout < now)
             sleepfor = 0;
         else
@@ -1712,13 +1988,39 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
             timeout->tv_usec = 0;
         }
 
+#ifdef HAVE_SYS_EPOLL_H
+        if (prot_epoll_wait(readstreams, extra_read_fd, timeout) == -1)
+            return -1;
+#define PROT_FD_ISREADY(fd) prot_epoll_isready(readstreams, (fd))
+#else
+        /* do a select */
+        FD_ZERO(&rfds);
+
+        /* If extra_read_fd is PROT_NO_FD, then the first protstream
+         * will override it */
+        max_fd = extra_read_fd;
+        if(extra_read_fd != PROT_NO_FD) {
+            FD_SET(extra_read_fd, &rfds);
+        }
+
+        for(i = 0; i<readstreams->next_element; i++) {
+            s = readstreams->group[i];
+            if (!s) continue;
+
+            FD_SET(s->fd, &rfds);
+            if(s->fd > max_fd)
+                max_fd = s->fd;
+        }
+
         if(signals_select(max_fd + 1, &rfds, NULL, NULL, timeout) == -1)
             return -1;
+#define PROT_FD_ISREADY(fd) FD_ISSET((fd), &rfds)
+#endif
 
         /* Reset now */
         now = time(NULL);
 
-        if(extra_read_fd != PROT_NO_FD && FD_ISSET(extra_read_fd, &rfds)) {
+        if(extra_read_fd != PROT_NO_FD && PROT_FD_ISREADY(extra_read_fd)) {
             *extra_read_flag = 1;
             found_fds++;
         } else if(extra_read_flag) {
@@ -1729,7 +2031,7 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
             s = readstreams->group[i];
             if (!s) continue;
 
-            if(FD_ISSET(s->fd, &rfds)) {
+            if(PROT_FD_ISREADY(s->fd)) {
                 found_fds++;
 
                 if(!retval)
@@ -1747,6 +2049,7 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
                 protgroup_insert(retval, s);
             }
         }
+#undef PROT_FD_ISREADY
     }
 
     *out = retval;
@@ -1788,6 +2091,9 @@ EXPORTED struct protgroup *protgroup_new(size_t size)
     ret->nalloced = size;
     ret->next_element = 0;
     ret->group = xzmalloc(size * sizeof(struct protstream *));
+#ifdef HAVE_SYS_EPOLL_H
+    ret->epoll = NULL;
+#endif
 
     return ret;
 }
@@ -1818,6 +2124,9 @@ EXPORTED void protgroup_free(struct protgroup *group)
     if(group) {
         assert(group->group);
         free(group->group);
+#ifdef HAVE_SYS_EPOLL_H
+        prot_epoll_free(group->epoll);
+#endif
         free(group);
     }
 }
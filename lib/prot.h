@@ -83,6 +83,7 @@ struct protstream {
     int fd;         /* The Socket */
     int logfd;      /* The Telemetry Log (or PROT_NO_FD) */
     int big_buffer; /* The Big Buffer (or PROT_NO_FD) */
+    unsigned serial; /* Tells apart streams which reuse an fd number */
 
     /* SASL / TLS */
     sasl_conn_t *conn;
@@ -215,6 +215,27 @@ EXPORTED int signals_poll(void)
     return signals_poll_mask(NULL);
 }
 
+#if defined(HAVE_PSELECT) || defined(HAVE_SYS_EPOLL_H)
+/* temporarily block all the signals we want to be caught
+ * reliably, saving the old mask in 'oldmask' */
+static void signals_block(sigset_t *oldmask)
+{
+    sigset_t blocked;
+
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGALRM);
+    sigaddset(&blocked, SIGQUIT);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigprocmask(SIG_BLOCK, &blocked, oldmask);
+
+    /* Those signals will not arrive now.  Check to see if any
+     * of them arrived before we blocked them */
+    signals_poll_mask(oldmask);
+}
+#endif
+
 /*
  * Same interface as select() but closes the race between
  * select() blocking and delivery of some signficant signals
@@ -228,24 +249,11 @@ EXPORTED int signals_select(int nfds, fd_set *rfds, fd_set *wfds,
     /* pselect() closes the race between SIGCHLD arriving
     * and select() sleeping for up to 10 seconds. */
     struct timespec ts, *tsptr = NULL;
-    sigset_t blocked;
     sigset_t oldmask;
     int saved_errno;
     int r;
 
-    /* temporarily block all the signals we want
-     * to be caught reliably */
-    sigemptyset(&blocked);
-    sigaddset(&blocked, SIGCHLD);
-    sigaddset(&blocked, SIGALRM);
-    sigaddset(&blocked, SIGQUIT);
-    sigaddset(&blocked, SIGINT);
-    sigaddset(&blocked, SIGTERM);
-    sigprocmask(SIG_BLOCK, &blocked, &oldmask);
-
-    /* Those signals will not arrive now.  Check to see if any
-     * of them arrived before we blocked them */
-    signals_poll_mask(&oldmask);
+    signals_block(&oldmask);
 
     if (tout) {
         ts.tv_sec = tout->tv_sec;
@@ -276,6 +284,35 @@ EXPORTED int signals_select(int nfds, fd_set *rfds, fd_set *wfds,
 #endif
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * Same interface as epoll_wait(), closing the same race as
+ * signals_select() does.
+ */
+EXPORTED int signals_epoll_wait(int epfd, struct epoll_event *events,
+                                int maxevents, int timeout)
+{
+    sigset_t oldmask;
+    int saved_errno;
+    int r;
+
+    signals_block(&oldmask);
+
+    /* epoll_pwait() allows the restartable signals to arrive */
+    r = epoll_pwait(epfd, events, maxevents, timeout, &oldmask);
+
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+        signals_poll_mask(&oldmask);
+
+    /* restore the old signal mask */
+    saved_errno = errno;
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    errno = saved_errno;
+
+    return r;
+}
+#endif
+
 EXPORTED void signals_clear(int sig)
 {
     if (sig >= 0 && sig < _NSIG)
@@ -45,6 +45,9 @@
 
 #include <sys/select.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 typedef void shutdownfn(int);
 
@@ -54,6 +57,10 @@ void signals_set_shutdown(shutdownfn *s);
 int signals_poll(void);
 int signals_select(int nfds, fd_set *rfds, fd_set *wfds,
                    fd_set *efds, struct timeval *tout);
+#ifdef HAVE_SYS_EPOLL_H
+int signals_epoll_wait(int epfd, struct epoll_event *events,
+                       int maxevents, int timeout);
+#endif
 void signals_clear(int sig);
 int signals_cancelled();
 
@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "../cyrusdb.h"
 #include "../xmalloc.h"
@@ -127,6 +129,28 @@ int main(int argc, char *argv[])
             } else {
                 printf("no\n");
             }
+        } else if (!strncasecmp(buf, "bench ", 6)) {
+            /* time N single-record transactions, eg to compare
+             * the cost of syncing with twoskip_lazy_commit */
+            int i, n = atoi(buf + 6);
+            struct timeval start, end;
+            double secs;
+            char key[32];
+
+            if (n <= 0 || txnp) goto bad;
+            gettimeofday(&start, NULL);
+            for (i = 0; i < n; i++) {
+                int keylen = snprintf(key, sizeof(key), "bench%08d", i);
+                txn = NULL;
+                TRY(cyrusdb_store(db, key, keylen, key, keylen, &txn));
+                TRY(cyrusdb_commit(db, txn));
+            }
+            txn = NULL;
+            gettimeofday(&end, NULL);
+            secs = (end.tv_sec - start.tv_sec) +
+                   (end.tv_usec - start.tv_usec) / 1000000.0;
+            printf("ok %d commits in %.3f sec (%.1f/sec)\n",
+                   n, secs, secs > 0 ? n / secs : 0.0);
         } else if (!strncasecmp(buf, "txn", 3)) {
             if (txnp) {
                 printf("no\n");
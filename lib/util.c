@@ -58,6 +58,10 @@
 #include <sys/capability.h>
 #include <sys/prctl.h>
 #endif
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -479,6 +483,13 @@ static int _copyfile_helper(const char *from, const char *to, int flags)
         goto done;
     }
 
+#ifdef FICLONE
+    /* a reflink shares the blocks but is still a private copy,
+     * so it's fine even when we were asked not to link */
+    if (!ioctl(destfd, FICLONE, srcfd) && !fsync(destfd))
+        goto done;
+#endif
+
     map_refresh(srcfd, 1, &src_base, &src_size, sbuf.st_size, from, 0);
 
     n = retry_write(destfd, src_base, src_size);
@@ -66,8 +66,12 @@ typedef uint8_t sha1_byte;    /* single byte type */
 #define SHA1_DIGEST_LENGTH  20
 #define SHA_DIGEST_LENGTH (SHA1_DIGEST_LENGTH)
 
-/* opaque type for the SHA1 structure: */
-typedef struct _SHA_CTX SHA_CTX;
+/* The SHA1 structure, visible so that contexts can live on the stack */
+typedef struct _SHA_CTX {
+    sha1_quadbyte   state[5];
+    sha1_quadbyte   count[2];
+    sha1_byte   buffer[SHA1_BLOCK_LENGTH];
+} SHA_CTX;
 
 int SHA1_Init(SHA_CTX* context);
 int SHA1_Update(SHA_CTX *context, const sha1_byte *data, unsigned int len);
@@ -145,7 +145,8 @@ int main(int argc, char *argv[])
     /* open database */
     strcpy(fnamebuf, config_dir);
     strcat(fnamebuf, PTS_DBFIL);
-    r = cyrusdb_open(config_ptscache_db, fnamebuf, CYRUSDB_CREATE, &ptdb);
+    r = cyrusdb_open(config_ptscache_db, fnamebuf,
+                     CYRUSDB_CREATE | CYRUSDB_LAZYCOMMIT, &ptdb);
     if(r != CYRUSDB_OK) {
         syslog(LOG_ERR, "error opening %s (%s)", fnamebuf,
                cyrusdb_strerror(r));
@@ -158,7 +158,8 @@ int service_init(int argc, char *argv[], char **envp __attribute__((unused)))
 
     strcpy(fnamebuf, config_dir);
     strcat(fnamebuf, PTS_DBFIL);
-    r = cyrusdb_open(DB, fnamebuf, CYRUSDB_CREATE, &ptsdb);
+    r = cyrusdb_open(DB, fnamebuf, CYRUSDB_CREATE | CYRUSDB_LAZYCOMMIT,
+                     &ptsdb);
     if (r != 0) {
         syslog(LOG_ERR, "DBERROR: opening %s: %s", fnamebuf,
                cyrusdb_strerror(ret));
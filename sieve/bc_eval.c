@@ -117,6 +117,76 @@ static const char ** bc_makeArray(bytecode_input_t *bc, int *pos)
     return array;
 }
 
+/*
+ * Scripts generated by webmail filters often have hundreds of tests on
+ * the same few headers.  Rather than decoding those header values and
+ * compiling the regexes again for every test, remember them for the
+ * rest of the message: decoded values are keyed by the raw value that
+ * the getheader callback returned, and regexes by their pattern in the
+ * (still mapped) bytecode.  The memo is emptied whenever a top-level
+ * script evaluation starts.
+ */
+struct memo_header {
+    const char *raw;
+    char *decoded;
+    size_t len;
+};
+
+struct memo_regex {
+    const char *pattern;
+    int ctag;
+    regex_t *reg;
+};
+
+static struct {
+    struct memo_header *headers;
+    int nheaders, headers_alloc;
+    struct memo_regex *regexes;
+    int nregexes, regexes_alloc;
+} memo;
+
+static void memo_reset(void)
+{
+    int n;
+
+    for (n = 0; n < memo.nheaders; n++)
+        free(memo.headers[n].decoded);
+    memo.nheaders = 0;
+
+    for (n = 0; n < memo.nregexes; n++) {
+        regfree(memo.regexes[n].reg);
+        free(memo.regexes[n].reg);
+    }
+    memo.nregexes = 0;
+}
+
+/* Return the decoded form of header value 'raw', and its length */
+static const char *memo_decoded_header(const char *raw, size_t *len)
+{
+    struct memo_header *h;
+    int n;
+
+    for (n = 0; n < memo.nheaders; n++) {
+        if (memo.headers[n].raw == raw) {
+            *len = memo.headers[n].len;
+            return memo.headers[n].decoded;
+        }
+    }
+
+    if (memo.nheaders == memo.headers_alloc) {
+        memo.headers_alloc += 16;
+        memo.headers = xrealloc(memo.headers, memo.headers_alloc *
+                                sizeof(struct memo_header));
+    }
+    h = &memo.headers[memo.nheaders++];
+    h->raw = raw;
+    h->decoded = charset_parse_mimeheader(raw);
+    h->len = strlen(h->decoded);
+
+    *len = h->len;
+    return h->decoded;
+}
+
 /* Compile a regular expression for use during parsing */
 static regex_t * bc_compile_regex(const char *s, int ctag,
                                   char *errmsg, size_t errsiz)
@@ -137,6 +207,35 @@ static regex_t * bc_compile_regex(const char *s, int ctag,
     return reg;
 }
 
+/* Return the compiled form of 'pattern', compiling it on first use */
+static regex_t *memo_regex(const char *pattern, int ctag,
+                           char *errmsg, size_t errsiz)
+{
+    struct memo_regex *r;
+    regex_t *reg;
+    int n;
+
+    for (n = 0; n < memo.nregexes; n++) {
+        if (memo.regexes[n].pattern == pattern && memo.regexes[n].ctag == ctag)
+            return memo.regexes[n].reg;
+    }
+
+    reg = bc_compile_regex(pattern, ctag, errmsg, errsiz);
+    if (!reg) return NULL;
+
+    if (memo.nregexes == memo.regexes_alloc) {
+        memo.regexes_alloc += 16;
+        memo.regexes = xrealloc(memo.regexes, memo.regexes_alloc *
+                                sizeof(struct memo_regex));
+    }
+    r = &memo.regexes[memo.nregexes++];
+    r->pattern = pattern;
+    r->ctag = ctag;
+    r->reg = reg;
+
+    return reg;
+}
+
 /* Determine if addr is a system address */
 static int sysaddr(const char *addr)
 {
@@ -636,8 +735,8 @@ static int eval_bc_test(sieve_interp_t *interp, void* m,
                             currd = unwrap_string(bc, currd, &data_val, NULL);
 
                             if (isReg) {
-                                reg = bc_compile_regex(data_val, ctag,
-                                                       errbuf, sizeof(errbuf));
+                                reg = memo_regex(data_val, ctag,
+                                                 errbuf, sizeof(errbuf));
                                 if (!reg) {
                                     /* Oops */
                                     free(addr);
@@ -647,7 +746,6 @@ static int eval_bc_test(sieve_interp_t *interp, void* m,
 
                                 res |= comp(addr, strlen(addr),
                                             (const char *)reg, comprock);
-                                free(reg);
                             } else {
 #if VERBOSE
                                 printf("%s compared to %s(from script)\n",
@@ -736,7 +834,8 @@ envelope_err:
         int ctag = 0;
         regex_t *reg;
         char errbuf[100]; /* Basically unused, regexps tested at compile */
-        char *decoded_header;
+        const char *decoded_header;
+        size_t decoded_len;
 
         /* set up variables needed for compiling regex */
         if (isReg)
@@ -806,7 +905,7 @@ envelope_err:
                 if  (match == B_COUNT) {
                     count++;
                 } else {
-                    decoded_header = charset_parse_mimeheader(val[y]);
+                    decoded_header = memo_decoded_header(val[y], &decoded_len);
                     /*search through all the data*/
                     currd=datai+2;
                     for (z=0; z<numdata && !res; z++)
@@ -816,8 +915,8 @@ envelope_err:
                         currd = unwrap_string(bc, currd, &data_val, NULL);
 
                         if (isReg) {
-                            reg= bc_compile_regex(data_val, ctag, errbuf,
-                                                  sizeof(errbuf));
+                            reg= memo_regex(data_val, ctag, errbuf,
+                                            sizeof(errbuf));
                             if (!reg)
                             {
                                 /* Oops */
@@ -825,15 +924,13 @@ envelope_err:
                                 goto alldone;
                             }
 
-                            res |= comp(decoded_header, strlen(decoded_header),
+                            res |= comp(decoded_header, decoded_len,
                                         (const char *)reg, comprock);
-                            free(reg);
                         } else {
-                            res |= comp(decoded_header, strlen(decoded_header),
+                            res |= comp(decoded_header, decoded_len,
                                         data_val, comprock);
                         }
                     }
-                    free(decoded_header);
                 }
             }
         }
@@ -940,8 +1037,8 @@ envelope_err:
                 active_flag = workingflags->data[y];
 
                 if (isReg) {
-                    reg= bc_compile_regex(this_needle, ctag, errbuf,
-                                          sizeof(errbuf));
+                    reg= memo_regex(this_needle, ctag, errbuf,
+                                    sizeof(errbuf));
                     if (!reg)
                     {
                         /* Oops */
@@ -951,7 +1048,6 @@ envelope_err:
 
                     res |= comp(active_flag, strlen(active_flag),
                                 (const char *)reg, comprock);
-                    free(reg);
                 } else {
                     res |= comp(active_flag, strlen(active_flag),
                                 this_needle, comprock);
@@ -1044,8 +1140,8 @@ envelope_err:
                     currd = unwrap_string(bc, currd, &data_val, NULL);
 
                     if (isReg) {
-                        reg = bc_compile_regex(data_val, ctag,
-                                               errbuf, sizeof(errbuf));
+                        reg = memo_regex(data_val, ctag,
+                                         errbuf, sizeof(errbuf));
                         if (!reg) {
                             /* Oops */
                             res=-1;
@@ -1053,7 +1149,6 @@ envelope_err:
                         }
 
                         res |= comp(content, strlen(content), (const char *)reg, comprock);
-                        free(reg);
                     } else {
                         res |= comp(content, strlen(content), data_val, comprock);
                     }
@@ -1412,6 +1507,9 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
     bytecode_input_t *bc = (bytecode_input_t *) bc_cur->data;
     int ip = 0, ip_max = (bc_cur->len/sizeof(bytecode_input_t));
 
+    /* a new message: forget what we memoized for the last one */
+    if (!is_incl) memo_reset();
+
     if (bc_cur->is_executing) {
         *errmsg = "Recursive Include";
         return SIEVE_RUN_ERROR;
@@ -421,13 +421,36 @@ static char *sieve_errstr(int code)
 /******************************bytecode functions*****************************
  *****************************************************************************/
 
+static void bytecode_setstat(sieve_bytecode_t *bc, const struct stat *sbuf)
+{
+    bc->dev = sbuf->st_dev;
+    bc->inode = sbuf->st_ino;
+    bc->size = sbuf->st_size;
+    bc->mtime = sbuf->st_mtime;
+}
+
+static int bytecode_changed(const sieve_bytecode_t *bc,
+                            const struct stat *sbuf)
+{
+    return bc->dev != sbuf->st_dev || bc->inode != sbuf->st_ino ||
+           bc->size != sbuf->st_size || bc->mtime != sbuf->st_mtime;
+}
+
+static void bytecode_free(sieve_bytecode_t *bc)
+{
+    map_free(&(bc->data), &(bc->len));
+    close(bc->fd);
+    free(bc->fname);
+    free(bc);
+}
+
 /* Load a compiled script */
 EXPORTED int sieve_script_load(const char *fname, sieve_execute_t **ret)
 {
     struct stat sbuf;
     sieve_execute_t *ex;
-    sieve_bytecode_t *bc;
-    int dofree = 0;
+    sieve_bytecode_t *bc, **bcp;
+    int dofree = 0, included = 0;
 
     if (!fname || !ret) return SIEVE_FAIL;
 
@@ -449,11 +472,31 @@ EXPORTED int sieve_script_load(const char *fname, sieve_execute_t **ret)
         ex = *ret;
     }
 
-    /* see if we already have this script loaded */
-    bc = ex->bc_list;
-    while (bc) {
-        if (sbuf.st_ino == bc->inode) break;
-        bc = bc->next;
+    /* see if we already have this script loaded, and drop any earlier
+     * version of it which has since been replaced, unless it's running
+     * or is the top level script */
+    bcp = &ex->bc_list;
+    while ((bc = *bcp)) {
+        if (bc->dev == sbuf.st_dev && bc->inode == sbuf.st_ino) break;
+
+        if (!strcmp(bc->fname, fname) && !bc->is_executing &&
+            bc != ex->bc_main) {
+            if (bc->generation == ex->generation) included = 1;
+            *bcp = bc->next;
+            bytecode_free(bc);
+            continue;
+        }
+
+        bcp = &bc->next;
+    }
+
+    if (bc && (bc->size != sbuf.st_size || bc->mtime != sbuf.st_mtime) &&
+        !bc->is_executing) {
+        /* rewritten in place: map it again */
+        bytecode_setstat(bc, &sbuf);
+        map_free(&bc->data, &bc->len);
+        map_refresh(bc->fd, 1, &bc->data, &bc->len, sbuf.st_size,
+                    fname, "sievescript");
     }
 
     if (!bc) {
@@ -475,8 +518,10 @@ EXPORTED int sieve_script_load(const char *fname, sieve_execute_t **ret)
 
         bc = (sieve_bytecode_t *) xzmalloc(sizeof(sieve_bytecode_t));
 
+        bc->fname = xstrdup(fname);
         bc->fd = fd;
-        bc->inode = sbuf.st_ino;
+        bytecode_setstat(bc, &sbuf);
+        bc->generation = ex->generation;
 
         map_refresh(fd, 1, &bc->data, &bc->len, sbuf.st_size,
                     fname, "sievescript");
@@ -485,6 +530,15 @@ EXPORTED int sieve_script_load(const char *fname, sieve_execute_t **ret)
         bc->next = ex->bc_list;
         ex->bc_list = bc;
 
+        ex->bc_cur = bc;
+        if (dofree) ex->bc_main = bc;
+        *ret = ex;
+        /* a new version of a script already included by this execution
+         * still counts as included, for INCLUDE :once */
+        return included ? SIEVE_SCRIPT_RELOADED : SIEVE_OK;
+    } else if (bc->generation != ex->generation) {
+        /* script was loaded by an earlier execution of a cached script */
+        bc->generation = ex->generation;
         ex->bc_cur = bc;
         *ret = ex;
         return SIEVE_OK;
@@ -496,7 +550,23 @@ EXPORTED int sieve_script_load(const char *fname, sieve_execute_t **ret)
     }
 }
 
+/*
+ * Check whether any of the scripts loaded into 'exe', the top level one
+ * or any it has included, has been replaced or rewritten since it was
+ * loaded, so that a kept sieve_execute_t can be reloaded.
+ */
+EXPORTED int sieve_script_changed(sieve_execute_t *exe)
+{
+    sieve_bytecode_t *bc;
+    struct stat sbuf;
+
+    for (bc = exe->bc_list; bc; bc = bc->next) {
+        if (stat(bc->fname, &sbuf) == -1 || bytecode_changed(bc, &sbuf))
+            return 1;
+    }
 
+    return 0;
+}
 
 EXPORTED int sieve_script_unload(sieve_execute_t **s)
 {
@@ -506,10 +576,8 @@ EXPORTED int sieve_script_unload(sieve_execute_t **s)
 
         /* free each bytecode buffer in the linked list */
         while (bc) {
-            map_free(&(bc->data), &(bc->len));
-            close(bc->fd);
             nextbc = bc->next;
-            free(bc);
+            bytecode_free(bc);
             bc = nextbc;
         }
         free(*s);
@@ -865,6 +933,18 @@ EXPORTED int sieve_execute_bytecode(sieve_execute_t *exe, sieve_interp_t *interp
 
     if (!interp) return SIEVE_FAIL;
 
+    /* the script may have been kept loaded from an earlier execution:
+     * start again from the top, with no INCLUDEs done yet */
+    if (exe->bc_main) {
+        sieve_bytecode_t *bc;
+
+        exe->generation++;
+        for (bc = exe->bc_list; bc; bc = bc->next)
+            bc->is_executing = 0;
+        exe->bc_cur = exe->bc_main;
+        exe->bc_main->generation = exe->generation;
+    }
+
     if (interp->notify) {
         notify_list = new_notify_list();
         if (notify_list == NULL) {
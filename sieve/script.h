@@ -85,12 +85,18 @@ struct sieve_script {
 typedef struct sieve_bytecode sieve_bytecode_t;
 
 struct sieve_bytecode {
-    ino_t inode;                /* used to prevent mmapping the same script */
+    char *fname;
+    dev_t dev;                  /* used to prevent mmapping the same script, */
+    ino_t inode;                /* and with size and mtime, to tell when */
+    off_t size;                 /* the file has changed since */
+    time_t mtime;
     const char *data;
     size_t len;
     int fd;
 
     int is_executing;           /* used to prevent recursive INCLUDEs */
+    unsigned long generation;   /* execution which last loaded this buffer,
+                                   for INCLUDE :once */
 
     sieve_bytecode_t *next;
 };
@@ -98,6 +104,9 @@ struct sieve_bytecode {
 struct sieve_execute {
     sieve_bytecode_t *bc_list;  /* list of loaded bytecode buffers */
     sieve_bytecode_t *bc_cur;   /* currently active bytecode buffer */
+    sieve_bytecode_t *bc_main;  /* buffer of the top level script */
+    unsigned long generation;   /* count of executions, so that a loaded
+                                   script can be executed again */
 };
 
 int script_require(sieve_script_t *s, char *req);
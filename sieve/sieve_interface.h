@@ -64,6 +64,8 @@ typedef int sieve_callback(void *action_context, void *interp_context,
                            void *script_context,
                            void *message_context, const char **errmsg);
 typedef int sieve_get_size(void *message_context, int *size);
+/* the header values returned must not change or move while the
+   message is being evaluated: their decoded forms are memoized */
 typedef int sieve_get_header(void *message_context,
                              const char *header,
                              const char ***contents);
@@ -183,6 +185,9 @@ int sieve_script_load(const char *fpath, sieve_execute_t **ret);
 /* Unload a sieve_bytecode_t */
 int sieve_script_unload(sieve_execute_t **s);
 
+/* Has any script loaded into the sieve_execute_t changed on disk? */
+int sieve_script_changed(sieve_execute_t *exe);
+
 /* Free a sieve_script_t */
 void sieve_script_free(sieve_script_t **s);
 